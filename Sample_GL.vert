@@ -4,19 +4,34 @@
 layout (location = 0) in vec3 vertexPosition;
 layout (location = 1) in vec3 vertexColor;
 
-uniform mat4 MVP;
+// per-frame camera data : one uniform buffer shared by every program, see setCamera()
+layout (std140) uniform Frame {
+    mat4 VP;
+    float pixelSize;  // world units covered by one pixel
+};
+
+// per-object data : the model matrix is composed here from a compact transform
+uniform vec4 transform;  // x, y, rotation in radians, scale
+uniform float depth;     // added to z, keeps the draw order
+uniform vec3 objectColor;
+uniform vec4 objectTint;
 
 // output data : used by fragment shader
 out vec3 fragColor;
 
 void main ()
 {
-    vec4 v = vec4(vertexPosition, 1); // Transform an homogeneous 4D vector
+    // Scale, rotate about z and move into place : the model matrix of this object
+    vec2 p = vertexPosition.xy * transform.w;
+    float c = cos(transform.z);
+    float s = sin(transform.z);
+    p = vec2(c * p.x - s * p.y, s * p.x + c * p.y) + transform.xy;
+    vec4 v = vec4(p, vertexPosition.z + depth, 1); // Transform an homogeneous 4D vector
 
     // The color of each vertex will be interpolated
-    // to produce the color of each fragment
-    fragColor = vertexColor;
+    // to produce the color of each fragment, colored by the object material
+    fragColor = mix(vertexColor * objectColor, objectTint.rgb, objectTint.a);
 
-    // Output position of the vertex, in clip space : MVP * position
-    gl_Position = MVP * v;
+    // Output position of the vertex, in clip space : VP * model * position
+    gl_Position = VP * v;
 }
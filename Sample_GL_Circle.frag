@@ -0,0 +1,28 @@
+#version 330 core
+
+// Interpolated values from the vertex shaders
+in vec3 fragColor;
+in vec2 circleCoord;
+
+uniform float outlineWidth;  // in pixels, 0 for no outline
+uniform vec3 outlineColor;
+
+// output data
+out vec4 color;
+
+void main()
+{
+    // Signed distance to the rim in pixels, negative inside the circle
+    float distance = length(circleCoord) - 1.0;
+    float edge = distance / fwidth(distance);
+
+    // Anti-aliased coverage of the pixel, blended over what is behind
+    float coverage = clamp(0.5 - edge, 0.0, 1.0);
+    if (coverage <= 0.0)
+        discard;
+
+    // Outline band of outlineWidth pixels just inside the rim
+    float outline = clamp(edge + outlineWidth + 0.5, 0.0, 1.0) * min(outlineWidth, 1.0);
+
+    color = vec4(mix(fragColor, outlineColor, outline), coverage);
+}
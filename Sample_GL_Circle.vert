@@ -0,0 +1,34 @@
+#version 330 core
+
+// input data : unit quad from (-1, -1) to (1, 1) shared by every circle
+layout (location = 0) in vec3 vertexPosition;
+
+// per-frame camera data : one uniform buffer shared by every program, see setCamera()
+layout (std140) uniform Frame {
+    mat4 VP;
+    float pixelSize;  // world units covered by one pixel
+};
+
+// per-instance data : same layout as Sample_GL_Instanced.vert
+uniform samplerBuffer instances;
+uniform int instanceBase;
+
+// output data : used by fragment shader
+out vec3 fragColor;
+out vec2 circleCoord;  // position in radii from the center
+
+void main ()
+{
+    int index = 4 * (instanceBase + gl_InstanceID);
+    vec4 transform = texelFetch(instances, index);
+    vec4 material = texelFetch(instances, index + 1);
+    vec4 tint = texelFetch(instances, index + 2);
+
+    // Grow the quad by a pixel so the anti-aliased rim is not clipped
+    float extent = transform.w + pixelSize;
+    circleCoord = vertexPosition.xy * extent / transform.w;
+
+    fragColor = mix(material.rgb, tint.rgb, tint.a);
+
+    gl_Position = VP * vec4(vertexPosition.xy * extent + transform.xy, material.w, 1);
+}
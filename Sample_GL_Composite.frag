@@ -0,0 +1,16 @@
+#version 330 core
+
+// cached layer, same size as the screen
+uniform sampler2D layerColor;
+uniform sampler2D layerDepth;
+
+// output data
+out vec3 color;
+
+void main()
+{
+    // Copy color and depth so later draws still sort against the layer
+    ivec2 texel = ivec2(gl_FragCoord.xy);
+    color = texelFetch(layerColor, texel, 0).rgb;
+    gl_FragDepth = texelFetch(layerDepth, texel, 0).r;
+}
@@ -0,0 +1,9 @@
+#version 330 core
+
+// no vertex buffer : one triangle from gl_VertexID covering the whole screen
+
+void main ()
+{
+    vec2 p = vec2((gl_VertexID & 1) * 4 - 1, (gl_VertexID & 2) * 2 - 1);
+    gl_Position = vec4(p, 0, 1);
+}
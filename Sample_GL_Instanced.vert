@@ -0,0 +1,39 @@
+#version 330 core
+
+// input data : unit polygon mesh shared by every instance of a side count
+layout (location = 0) in vec3 vertexPosition;
+layout (location = 1) in vec3 vertexColor;
+
+// per-frame camera data : one uniform buffer shared by every program, see setCamera()
+layout (std140) uniform Frame {
+    mat4 VP;
+    float pixelSize;  // world units covered by one pixel
+};
+
+// per-instance data : four texels per instance, see InstanceData in game.cpp
+// texel 0 = (x, y, rotation in radians, radius), texel 1 = (r, g, b, depth),
+// texel 2 = tint (r, g, b, amount), texel 3 = (sides, unused, unused, unused)
+uniform samplerBuffer instances;
+uniform int instanceBase;
+
+// output data : used by fragment shader
+out vec3 fragColor;
+
+void main ()
+{
+    int index = 4 * (instanceBase + gl_InstanceID);
+    vec4 transform = texelFetch(instances, index);
+    vec4 material = texelFetch(instances, index + 1);
+    vec4 tint = texelFetch(instances, index + 2);
+
+    // Scale the unit mesh to the radius, rotate about z and move into place
+    vec2 p = vertexPosition.xy * transform.w;
+    float c = cos(transform.z);
+    float s = sin(transform.z);
+    p = vec2(c * p.x - s * p.y, s * p.x + c * p.y) + transform.xy;
+
+    fragColor = mix(vertexColor * material.rgb, tint.rgb, tint.a);
+
+    // Depth carries the draw order so groups can be drawn in any order
+    gl_Position = VP * vec4(p, material.w, 1);
+}
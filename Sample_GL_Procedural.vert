@@ -0,0 +1,41 @@
+#version 330 core
+
+// no vertex buffer : the polygon is built from gl_VertexID,
+// triangle t of a polygon uses the center and rim points t + 1 and t + 2,
+// triangles past the instance's side count collapse onto the center
+
+// per-frame camera data : one uniform buffer shared by every program, see setCamera()
+layout (std140) uniform Frame {
+    mat4 VP;
+    float pixelSize;  // world units covered by one pixel
+};
+
+// per-instance data : same layout as Sample_GL_Instanced.vert,
+// texel 3 = (sides, unused, unused, unused)
+uniform samplerBuffer instances;
+uniform int instanceBase;
+
+// output data : used by fragment shader
+out vec3 fragColor;
+
+void main ()
+{
+    int index = 4 * (instanceBase + gl_InstanceID);
+    vec4 transform = texelFetch(instances, index);
+    vec4 material = texelFetch(instances, index + 1);
+    vec4 tint = texelFetch(instances, index + 2);
+    int sides = int(texelFetch(instances, index + 3).x);
+
+    int triangle = gl_VertexID / 3;
+    int corner = gl_VertexID % 3;
+
+    vec2 p = vec2(0, 0);
+    if (triangle < sides && corner != 0) {
+        float angle = 6.28318530718 / float(sides) * float(triangle + corner) + transform.z;
+        p = vec2(cos(angle), sin(angle)) * transform.w;
+    }
+
+    fragColor = mix(material.rgb, tint.rgb, tint.a);
+
+    gl_Position = VP * vec4(p + transform.xy, material.w, 1);
+}
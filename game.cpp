@@ -1,12 +1,54 @@
 #include <iostream>
 #include <cmath>
+#include <cstdlib>
+#include <cstring>
 #include <fstream>
 #include <vector>
 #include <map>
+#include <algorithm>
 #include <string>
 #include <sstream>
+#include <chrono>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define USE_AVX_DISPATCH  // an AVX kernel is built next to the SSE2 one and picked at run time
+#include <immintrin.h>
+#endif
 #include <glad/glad.h>
+
+/* Builds with a headless backend have no window and leave GLFW out, -DUSE_SOFTWARE builds */
+/* only the software rasterizer and needs no GL stack either */
+#if !defined(USE_EGL) && !defined(USE_OSMESA) && !defined(USE_SOFTWARE)
+#define USE_GLFW
+#endif
+#ifdef USE_GLFW
 #include <GLFW/glfw3.h>
+#else
+typedef struct GLFWwindow GLFWwindow;  // never created, Output.window stays NULL
+#endif
+
+/* Headless backends, built with -DUSE_EGL and/or -DUSE_OSMESA */
+#ifdef USE_EGL
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#endif
+#ifdef USE_OSMESA
+#ifndef GLAPIENTRY
+#define GLAPIENTRY APIENTRY  // glad.h keeps GL/gl.h out, osmesa.h still wants this
+#endif
+#include <GL/osmesa.h>
+#endif
+
+#ifndef GL_TIME_ELAPSED
+#define GL_TIME_ELAPSED 0x88BF  // GL 3.3 / ARB_timer_query, newer than glad.h
+#endif
 
 #define GLM_FORCE_RADIANS
 #include <glm/glm.hpp>
@@ -23,19 +65,98 @@ struct VAO {
     GLenum PrimitiveMode;
     GLenum FillMode;
     int NumVertices;
+
+    bool AttributesEnabled;  // vertex attributes 0 and 1 switched on in this VAO
+
+    vector<GLfloat> vertices;  // CPU copies drawn by the software rasterizer, empty otherwise
+    vector<GLfloat> colors;
 };
 
 typedef struct VAO VAO;
 
 struct GLMatrices {
 	glm::mat4 projection;
-	glm::mat4 model;
 	glm::mat4 view;
-	GLuint MatrixID;
+	GLuint FrameBuffer;   // uniform buffer behind the Frame block of every shader
+	GLuint TransformID;   // per-object transform, the model matrix is composed in the shader
+	GLuint DepthID;
 } Matrices;
 
+/* Layout of the std140 Frame block in the shaders */
+struct FrameBlock {
+	glm::mat4 VP;
+	GLfloat pixelSize;
+	GLfloat padding[3];
+};
+
+struct GLMaterial {
+	GLuint ColorID;
+	GLuint TintID;
+} Material;
+
 GLuint programID;
 
+struct GameOptions {
+    bool instancing;     // draw GameObjects with one instanced draw per side count
+    int stressObjects;   // extra pigs and coins spawned for stress levels
+    bool fanPolygons;    // triangle fan polygon meshes, false for the old separate triangles
+    bool stats;          // print render statistics every half second
+    bool lod;            // tessellate round objects by their size on screen
+    float lodTolerance;  // largest gap in pixels allowed between a round mesh and its circle
+    bool sdfCircles;     // draw round objects as quads shaded with a circle distance field
+    float circleOutline; // outline width in pixels for distance field circles, 0 for none
+    bool procedural;     // build instanced polygons in the vertex shader, no vertex buffers
+    bool staticLayer;    // cache the scenery in an offscreen layer, redrawn only when it changes
+    bool staticBatch;    // bake immovable scenery into one world space vertex buffer
+    int backend;         // OutputBackend : window, or headless EGL / OSMesa
+    int frames;          // stop after this many frames, 0 for no limit
+    string capture;      // directory to write every frame to, empty for no capture
+    bool capturePNG;     // PNG images instead of raw PPM
+    string golden;       // directory of reference frames to compare against, empty for none
+    bool goldenUpdate;   // write the reference frames instead of comparing
+    float goldenTolerance; // percent of pixels allowed to differ in a golden frame
+    bool dynamicResolution; // scale the scene's resolution to hold frameBudget
+    float frameBudget;   // GPU milliseconds per frame for the scene
+    float minScale, maxScale; // limits of the resolution scale
+    int pacing;          // PacingMode : vsync, adaptive vsync, uncapped or the sleep limiter
+    float frameRate;     // frames per second of the limiter
+    int framesInFlight;  // frames the CPU may queue ahead of the GPU, 1 to 3, 0 for the driver's choice
+    bool lateLatch;      // sample the cursor again just before the frame is built
+    bool cursorPrediction; // move the aim ahead along the cursor's velocity by the measured latency
+    float stepRate;      // simulation steps per second
+    int maxSteps;        // most steps run for one frame, the rest of the time is dropped
+    float gridCell;      // cell size of the broadphase grid in world units
+    int broadphase;      // BroadphaseKind, auto lets the level choose
+} Options = { true, 0, true, false, true, 0.5, false, 0, false, false, false, 0, 0, "", false, "", false, 0.05,
+              false, 14, 0.5, 1, 0, 60, 0, false, false, 60, 5, 0.5, 0 };
+
+/* Counters for the frames since the last statistics print */
+struct RenderStats {
+    int frames;
+    long drawCalls;
+    long vertices;      // vertices submitted, every instance counted
+    long stateCalls;    // state changes sent to GL through GLState
+    long elidedCalls;   // state changes GLState skipped because nothing changed
+    double drawTime;    // seconds of CPU time spent in drawAllObjects()
+    double captureTime; // seconds of render thread time spent capturing frames
+    double gpuTime;     // milliseconds of GPU time of the timed scenes
+    int gpuFrames;      // scenes timed
+    int staticRenders;  // times the static layer was redrawn
+    int batchBakes;     // full rebuilds of the static batch
+    int batchUpdates;   // objects rewritten in place in the static batch
+    long queueDepth;    // frames queued on the GPU at each present, summed
+    int queueSamples;
+    int maxQueueDepth;
+    double fenceWait;   // seconds spent waiting for frames in flight to finish
+    double aimLatency;  // seconds from the cursor sample to the present, summed
+    int simSteps;       // fixed simulation steps run
+    int droppedSteps;   // steps skipped because the frame fell too far behind
+    double simTime;     // seconds spent running them
+    long broadphasePairs; // candidate pairs found by the broadphase
+    long sweepSwaps;    // endpoint swaps sorting the sweep and prune list
+    long treeMoves;     // bodies reinserted in the bounding volume tree
+} Stats;
+
 /* Function to load Shaders - Use it as it is */
 GLuint LoadShaders(const char * vertex_file_path,const char * fragment_file_path) {
 
@@ -113,16 +234,178 @@ GLuint LoadShaders(const char * vertex_file_path,const char * fragment_file_path
 	return ProgramID;
 }
 
+/* Create the uniform buffer for the Frame block, updated once per frame by setCamera() */
+void initFrameBlock(){
+  glGenBuffers(1, &Matrices.FrameBuffer);
+  glBindBuffer(GL_UNIFORM_BUFFER, Matrices.FrameBuffer);
+  glBufferData(GL_UNIFORM_BUFFER, sizeof(FrameBlock), NULL, GL_DYNAMIC_DRAW);
+  glBindBufferBase(GL_UNIFORM_BUFFER, 0, Matrices.FrameBuffer);
+}
+
+/* Point the Frame block of a program at binding 0 */
+void bindFrameBlock(GLuint program){
+  GLuint index = glGetUniformBlockIndex(program, "Frame");
+  if(index != GL_INVALID_INDEX){
+    glUniformBlockBinding(program, index, 0);
+  }
+}
+
+/* Where frames go : a GLFW window, or an offscreen framebuffer of a headless context */
+enum OutputBackend { BACKEND_WINDOW, BACKEND_EGL, BACKEND_OSMESA, BACKEND_SOFTWARE };
+
+/* How presentFrame() waits for the next frame */
+enum PacingMode { PACING_VSYNC, PACING_ADAPTIVE, PACING_UNCAPPED, PACING_LIMIT };
+
+struct OutputTarget {
+    int backend;
+    GLFWwindow* window;         // BACKEND_WINDOW only
+    int width, height;
+
+    GLuint Framebuffer;         // what "the screen" is : 0 for the window and OSMesa, an FBO for EGL
+    GLuint ColorBuffer;
+    GLuint DepthBuffer;
+
+    int frame;                  // frames presented so far
+    int maxFrames;              // stop after this many frames, 0 runs until the window is closed
+    double cursorX, cursorY;    // headless backends have no mouse, the cursor stays here
+    chrono::steady_clock::time_point start;
+
+#ifdef USE_EGL
+    EGLDisplay eglDisplay;
+    EGLContext eglContext;
+#endif
+#ifdef USE_OSMESA
+    OSMesaContext osmesaContext;
+    vector<GLubyte> osmesaPixels;  // OSMesa renders into this
+#endif
+} Output;
+
+/* No GL at all, draw3DObject() rasterizes on the CPU */
+bool renderingInSoftware(){
+  return Output.backend == BACKEND_SOFTWARE;
+}
+
+/* Seconds since startup, from GLFW when there is a window */
+double currentTime(){
+#ifdef USE_GLFW
+  if(Output.backend == BACKEND_WINDOW){
+    return glfwGetTime();
+  }
+#endif
+  return chrono::duration<double>(chrono::steady_clock::now() - Output.start).count();
+}
+
+/* Dynamic resolution : the scene is drawn into an offscreen target at scale times the framebuffer */
+/* size and blitted up to the screen; the scale follows the scene's GPU time from timer queries */
+const int RESOLUTION_QUERIES = 4;  // timer queries in flight, read when ready and never waited for
+
+struct DynamicResolution {
+    GLuint Framebuffer;
+    GLuint ColorBuffer;
+    GLuint DepthBuffer;
+    int width, height;              // allocated size, maxScale times the framebuffer
+    float scale;                    // of the framebuffer size, used for this frame
+
+    GLuint Queries[RESOLUTION_QUERIES];
+    bool pending[RESOLUTION_QUERIES];  // ended, result not read yet
+    int next;                       // query for the next scene
+    bool timing;                    // a query is running for this scene
+} Resolution;
+
+// where the scene is drawn : the scaled target, or the screen
+GLuint sceneFramebuffer(){
+  return Options.dynamicResolution ? Resolution.Framebuffer : Output.Framebuffer;
+}
+
+// fraction of the framebuffer size the scene is drawn at
+float renderScale(){
+  return Options.dynamicResolution ? Resolution.scale : 1;
+}
+
+#ifdef USE_GLFW
 static void error_callback(int error, const char* description){
     fprintf(stderr, "Error: %s\n", description);
 }
 
+// leave the main loop, so closeOutput() still finishes the capture and prints the summaries
 void quit(GLFWwindow *window){
-    glfwDestroyWindow(window);
-    glfwTerminate();
-    exit(EXIT_SUCCESS);
+    glfwSetWindowShouldClose(window, GL_TRUE);
+}
+#endif
+
+
+/* Remembers the GL state set through it and skips calls that would not change it */
+/* All draw code binds programs, VAOs, array buffers and fill modes through here */
+struct GLStateCache {
+    GLuint program;
+    GLuint vertexArray;
+    GLuint arrayBuffer;
+    GLenum fillMode;
+
+    bool materialSet;   // color and tint below were uploaded to programID
+    glm::vec3 color;
+    glm::vec4 tint;
+} GLState = { 0, 0, 0, GL_FILL, false, glm::vec3(0), glm::vec4(0) };
+
+// true when the call has to reach GL, counts the ones that do not
+bool stateChanged (bool changed){
+  if(changed){
+    Stats.stateCalls++;
+  }
+  else {
+    Stats.elidedCalls++;
+  }
+  return changed;
+}
+
+void useProgram (GLuint program){
+  if(stateChanged(GLState.program != program)){
+    GLState.program = program;
+    glUseProgram (program);
+  }
+}
+
+void bindVertexArray (GLuint vertexArray){
+  if(stateChanged(GLState.vertexArray != vertexArray)){
+    GLState.vertexArray = vertexArray;
+    glBindVertexArray (vertexArray);
+  }
+}
+
+void bindArrayBuffer (GLuint buffer){
+  if(stateChanged(GLState.arrayBuffer != buffer)){
+    GLState.arrayBuffer = buffer;
+    glBindBuffer (GL_ARRAY_BUFFER, buffer);
+  }
+}
+
+void setPolygonMode (GLenum fillMode){
+  if(stateChanged(GLState.fillMode != fillMode)){
+    GLState.fillMode = fillMode;
+    glPolygonMode (GL_FRONT_AND_BACK, fillMode);
+  }
+}
+
+// enabled attributes are part of the VAO, so each VAO needs this only once
+void enableVertexAttributes (struct VAO* vao){
+  if(stateChanged(!vao->AttributesEnabled)){
+    vao->AttributesEnabled = true;
+    glEnableVertexAttribArray(0);
+    glEnableVertexAttribArray(1);
+  }
 }
 
+// object color and tint uniforms of programID, which must be in use
+void setMaterial (glm::vec3 color, glm::vec4 tint){
+  bool same = GLState.materialSet && GLState.color == color && GLState.tint == tint;
+  if(stateChanged(!same)){
+    GLState.materialSet = true;
+    GLState.color = color;
+    GLState.tint = tint;
+    glUniform3fv(Material.ColorID, 1, &color[0]);
+    glUniform4fv(Material.TintID, 1, &tint[0]);
+  }
+}
 
 /* Generate VAO, VBOs and return VAO handle */
 struct VAO* create3DObject (GLenum primitive_mode, int numVertices, const GLfloat* vertex_buffer_data, const GLfloat* color_buffer_data, GLenum fill_mode=GL_FILL){
@@ -130,6 +413,15 @@ struct VAO* create3DObject (GLenum primitive_mode, int numVertices, const GLfloa
     vao->PrimitiveMode = primitive_mode;
     vao->NumVertices = numVertices;
     vao->FillMode = fill_mode;
+    vao->AttributesEnabled = false;
+
+    if(renderingInSoftware()){
+      // no GL objects, draw3DObject() rasterizes the CPU copies
+      vao->VertexArrayID = vao->VertexBuffer = vao->ColorBuffer = 0;
+      vao->vertices.assign(vertex_buffer_data, vertex_buffer_data + 3*numVertices);
+      vao->colors.assign(color_buffer_data, color_buffer_data + 3*numVertices);
+      return vao;
+    }
 
     // Create Vertex Array Object
     // Should be done after CreateWindow and before any other GL calls
@@ -137,8 +429,8 @@ struct VAO* create3DObject (GLenum primitive_mode, int numVertices, const GLfloa
     glGenBuffers (1, &(vao->VertexBuffer)); // VBO - vertices
     glGenBuffers (1, &(vao->ColorBuffer));  // VBO - colors
 
-    glBindVertexArray (vao->VertexArrayID); // Bind the VAO 
-    glBindBuffer (GL_ARRAY_BUFFER, vao->VertexBuffer); // Bind the VBO vertices 
+    bindVertexArray (vao->VertexArrayID); // Bind the VAO 
+    bindArrayBuffer (vao->VertexBuffer); // Bind the VBO vertices 
     glBufferData (GL_ARRAY_BUFFER, 3*numVertices*sizeof(GLfloat), vertex_buffer_data, GL_STATIC_DRAW); // Copy the vertices into VBO
     glVertexAttribPointer(
                           0,                  // attribute 0. Vertices
@@ -149,7 +441,7 @@ struct VAO* create3DObject (GLenum primitive_mode, int numVertices, const GLfloa
                           (void*)0            // array buffer offset
                           );
 
-    glBindBuffer (GL_ARRAY_BUFFER, vao->ColorBuffer); // Bind the VBO colors 
+    bindArrayBuffer (vao->ColorBuffer); // Bind the VBO colors 
     glBufferData (GL_ARRAY_BUFFER, 3*numVertices*sizeof(GLfloat), color_buffer_data, GL_STATIC_DRAW);  // Copy the vertex colors
     glVertexAttribPointer(
                           1,                  // attribute 1. Color
@@ -175,42 +467,500 @@ struct VAO* create3DObject (GLenum primitive_mode, int numVertices, const GLfloa
     return create3DObject(primitive_mode, numVertices, vertex_buffer_data, color_buffer_data, fill_mode);
 }
   
+/* Software rasterizer behind draw3DObject() for --backend software */
+/* draw3DObject() shades the vertices like Sample_GL.vert and bins the primitives into screen tiles, */
+/* finishSoftwareFrame() then rasterizes the tiles on every core, four pixels at a time with SSE2 */
+const int SOFTWARE_TILE = 64;       // tile edge in pixels
+const int SOFTWARE_SUBPIXEL = 16;   // fixed point steps per pixel for triangle edges
+
+struct SoftwareVertex {
+    float x, y, z;      // window coordinates, z in [0, 1]
+    float r, g, b;
+};
+
+struct SoftwareClipVertex {
+    glm::vec4 clip;     // before the divide, so it can be clipped against the near and far planes
+    float r, g, b;
+};
+
+struct SoftwarePrimitive {
+    bool line;          // two vertices, else a triangle
+    bool flat;          // all vertices have the same color
+    SoftwareVertex v[3];
+};
+
+struct SoftwareRenderer {
+    int width, height;
+    int tilesX, tilesY;
+    vector<GLubyte> color;      // rgb, bottom row first like glReadPixels()
+    vector<float> depth;
+    glm::vec3 clearColor;
+
+    glm::mat4 VP;               // camera, set by setCamera()
+    glm::vec4 transform;        // uniforms of Sample_GL.vert, set by submitDrawList()
+    float drawDepth;
+    glm::vec3 objectColor;
+    glm::vec4 objectTint;
+
+    vector<SoftwareClipVertex> shaded;      // vertices of the current draw
+    vector<SoftwarePrimitive> primitives;   // primitives of this frame, in draw order
+    vector< vector<int> > bins;             // primitives touching each tile, in draw order
+    int threads;
+
+    vector<thread> workers;     // threads - 1 of them, the main thread rasterizes too
+    mutex lock;
+    condition_variable start;   // a frame was binned
+    condition_variable done;    // a worker ran out of tiles
+    int frame;                  // frames handed to the workers so far
+    int working;                // workers still rasterizing the current frame
+    bool stopping;
+    atomic<int> nextTile;
+} Software;
+
+void initSoftware (int width, int height){
+  Software.width = width;
+  Software.height = height;
+  Software.tilesX = (width + SOFTWARE_TILE - 1) / SOFTWARE_TILE;
+  Software.tilesY = (height + SOFTWARE_TILE - 1) / SOFTWARE_TILE;
+  Software.color.assign(3 * width * height, 0);
+  Software.depth.assign(width * height, 1);
+  Software.bins.resize(Software.tilesX * Software.tilesY);
+  Software.clearColor = glm::vec3(0.3f, 0.3f, 0.3f);
+  Software.threads = max(1, (int)thread::hardware_concurrency());
+}
+
+// start a frame with the camera VP, the tiles are cleared when they are rasterized
+void beginSoftwareFrame (glm::mat4 VP){
+  Software.VP = VP;
+  Software.primitives.clear();
+  for(size_t i = 0; i < Software.bins.size(); i++){
+    Software.bins[i].clear();
+  }
+}
+
+// Sample_GL.vert on the CPU : compose the model transform and project
+SoftwareClipVertex shadeSoftwareVertex (const GLfloat* position, const GLfloat* color, float c, float s){
+  glm::vec4 &transform = Software.transform;
+  float x = position[0] * transform.w, y = position[1] * transform.w;
+
+  SoftwareClipVertex vertex;
+  vertex.clip = Software.VP * glm::vec4(c * x - s * y + transform.x, s * x + c * y + transform.y, position[2] + Software.drawDepth, 1);
+
+  glm::vec4 &tint = Software.objectTint;
+  vertex.r = color[0] * Software.objectColor.x * (1 - tint.w) + tint.x * tint.w;
+  vertex.g = color[1] * Software.objectColor.y * (1 - tint.w) + tint.y * tint.w;
+  vertex.b = color[2] * Software.objectColor.z * (1 - tint.w) + tint.z * tint.w;
+  return vertex;
+}
+
+// divide and map to the window, z is clamped since clipped vertices can round just past a plane
+SoftwareVertex projectSoftwareVertex (const SoftwareClipVertex &in){
+  SoftwareVertex vertex;
+  vertex.x = (in.clip.x / in.clip.w + 1) * 0.5f * Software.width;
+  vertex.y = (in.clip.y / in.clip.w + 1) * 0.5f * Software.height;
+  vertex.z = min(max((in.clip.z / in.clip.w + 1) * 0.5f, 0.0f), 1.0f);
+  vertex.r = in.r;
+  vertex.g = in.g;
+  vertex.b = in.b;
+  return vertex;
+}
+
+// add a projected primitive to the frame and to every tile its bounding box touches
+void binSoftwareWindowPrimitive (SoftwarePrimitive &primitive){
+  float minX = 1e30f, minY = 1e30f, maxX = -1e30f, maxY = -1e30f;
+  for(int i = 0; i < 3; i++){
+    SoftwareVertex &v = primitive.v[i];
+    // far off screen : dropped, only the near and far planes are clipped
+    if(!(fabs(v.x) < 1e6f && fabs(v.y) < 1e6f)){
+      return;
+    }
+    minX = min(minX, v.x);
+    minY = min(minY, v.y);
+    maxX = max(maxX, v.x);
+    maxY = max(maxY, v.y);
+  }
+
+  int x0 = max(0, (int)floor(minX)), x1 = min(Software.width - 1, (int)ceil(maxX));
+  int y0 = max(0, (int)floor(minY)), y1 = min(Software.height - 1, (int)ceil(maxY));
+  if(x0 > x1 || y0 > y1){
+    return;
+  }
+
+  primitive.flat = true;
+  for(int i = 1; i < 3; i++){
+    SoftwareVertex &v = primitive.v[i];
+    primitive.flat = primitive.flat && v.r == primitive.v[0].r && v.g == primitive.v[0].g && v.b == primitive.v[0].b;
+  }
+
+  int index = Software.primitives.size();
+  Software.primitives.push_back(primitive);
+  for(int ty = y0 / SOFTWARE_TILE; ty <= y1 / SOFTWARE_TILE; ty++){
+    for(int tx = x0 / SOFTWARE_TILE; tx <= x1 / SOFTWARE_TILE; tx++){
+      Software.bins[ty * Software.tilesX + tx].push_back(index);
+    }
+  }
+}
+
+// point where the edge a b crosses a plane, d is the signed distance of each end to it
+SoftwareClipVertex intersectSoftwareEdge (const SoftwareClipVertex &a, const SoftwareClipVertex &b, float da, float db){
+  float t = da / (da - db);
+  SoftwareClipVertex vertex;
+  vertex.clip = a.clip + t * (b.clip - a.clip);
+  vertex.r = a.r + t * (b.r - a.r);
+  vertex.g = a.g + t * (b.g - a.g);
+  vertex.b = a.b + t * (b.b - a.b);
+  return vertex;
+}
+
+// keep the part of the polygon (or line, with n = 2) in front of the plane, z + w >= 0 (near) or w - z >= 0 (far)
+int clipSoftwarePolygon (const SoftwareClipVertex* in, int n, SoftwareClipVertex* out, float side){
+  int count = 0;
+  int edges = (n == 2) ? 1 : n;
+  for(int i = 0; i < edges; i++){
+    const SoftwareClipVertex &a = in[i], &b = in[(i + 1) % n];
+    float da = a.clip.w + side * a.clip.z, db = b.clip.w + side * b.clip.z;
+    if(da >= 0){
+      out[count++] = a;
+    }
+    if((da >= 0) != (db >= 0)){
+      out[count++] = intersectSoftwareEdge(a, b, da, db);
+    }
+    if(n == 2 && db >= 0){
+      out[count++] = b;
+    }
+  }
+  return count;
+}
+
+// clip a primitive of the current draw against the near and far planes, then project and bin what is left
+void binSoftwarePrimitive (bool line, int a, int b, int c){
+  SoftwareClipVertex polygon[5] = { Software.shaded[a], Software.shaded[b], Software.shaded[c] };
+  int n = line ? 2 : 3;
+
+  bool inside = true;
+  for(int i = 0; i < n; i++){
+    glm::vec4 &clip = polygon[i].clip;
+    inside = inside && clip.w + clip.z >= 0 && clip.w - clip.z >= 0;
+  }
+  if(!inside){
+    // a triangle gains at most one vertex per plane
+    SoftwareClipVertex nearClipped[5];
+    n = clipSoftwarePolygon(polygon, n, nearClipped, 1);
+    n = clipSoftwarePolygon(nearClipped, n, polygon, -1);
+    if(n < (line ? 2 : 3)){
+      return;
+    }
+  }
+
+  // a fan over the clipped polygon, a line stays a line
+  SoftwarePrimitive primitive;
+  primitive.line = line;
+  primitive.v[0] = projectSoftwareVertex(polygon[0]);
+  for(int i = 1; i + (line ? 0 : 1) < n; i++){
+    primitive.v[1] = projectSoftwareVertex(polygon[i]);
+    primitive.v[2] = line ? primitive.v[1] : projectSoftwareVertex(polygon[i + 1]);
+    binSoftwareWindowPrimitive(primitive);
+  }
+}
+
+// what draw3DObject() does without GL : shade the VAO's vertices and bin its primitives
+void rasterize3DObject (struct VAO* vao){
+  int n = min(vao->NumVertices, (int)vao->vertices.size() / 3);
+  float c = cos(Software.transform.z), s = sin(Software.transform.z);
+
+  Software.shaded.resize(n);
+  for(int i = 0; i < n; i++){
+    Software.shaded[i] = shadeSoftwareVertex(&vao->vertices[3*i], &vao->colors[3*i], c, s);
+  }
+
+  switch(vao->PrimitiveMode){
+    case GL_TRIANGLES:
+      for(int i = 0; i + 2 < n; i += 3){
+        binSoftwarePrimitive(false, i, i + 1, i + 2);
+      }
+      break;
+    case GL_TRIANGLE_FAN:
+      for(int i = 1; i + 1 < n; i++){
+        binSoftwarePrimitive(false, 0, i, i + 1);
+      }
+      break;
+    case GL_TRIANGLE_STRIP:
+      for(int i = 0; i + 2 < n; i++){
+        binSoftwarePrimitive(false, i, i + 1, i + 2);
+      }
+      break;
+    case GL_LINES:
+      for(int i = 0; i + 1 < n; i += 2){
+        binSoftwarePrimitive(true, i, i + 1, i + 1);
+      }
+      break;
+  }
+}
+
+// depth test (GL_LEQUAL) and write one pixel, the weights interpolate depth and color
+inline void writeSoftwarePixel (const SoftwarePrimitive &primitive, int x, int y, float w0, float w1, float w2){
+  const SoftwareVertex *v = primitive.v;
+  int index = y * Software.width + x;
+  float z = w0 * v[0].z + w1 * v[1].z + w2 * v[2].z;
+  if(z > Software.depth[index]){
+    return;
+  }
+  Software.depth[index] = z;
+
+  float r = v[0].r, g = v[0].g, b = v[0].b;
+  if(!primitive.flat){
+    r = w0 * v[0].r + w1 * v[1].r + w2 * v[2].r;
+    g = w0 * v[0].g + w1 * v[1].g + w2 * v[2].g;
+    b = w0 * v[0].b + w1 * v[1].b + w2 * v[2].b;
+  }
+  GLubyte *pixel = &Software.color[3 * index];
+  pixel[0] = (GLubyte)(min(max(r, 0.0f), 1.0f) * 255 + 0.5f);
+  pixel[1] = (GLubyte)(min(max(g, 0.0f), 1.0f) * 255 + 0.5f);
+  pixel[2] = (GLubyte)(min(max(b, 0.0f), 1.0f) * 255 + 0.5f);
+}
+
+// one triangle inside the tile [x0, x1) x [y0, y1), fixed point edge functions with the top-left rule
+void rasterizeSoftwareTriangle (const SoftwarePrimitive &primitive, int x0, int y0, int x1, int y1){
+  long long X[3], Y[3];
+  for(int i = 0; i < 3; i++){
+    X[i] = llround(primitive.v[i].x * SOFTWARE_SUBPIXEL);
+    Y[i] = llround(primitive.v[i].y * SOFTWARE_SUBPIXEL);
+  }
+  long long area = (X[1] - X[0]) * (Y[2] - Y[0]) - (Y[1] - Y[0]) * (X[2] - X[0]);
+  if(area == 0){
+    return;
+  }
+  int order[3] = { 0, 1, 2 };  // counter clockwise, so inside means every edge function positive
+  if(area < 0){
+    swap(order[1], order[2]);
+    area = -area;
+  }
+
+  // edge i is opposite vertex i, its function is that vertex's weight times the area
+  long long stepX[3], stepY[3], rowStart[3], bias[3];
+  int pxStart = max(x0, (int)floor(min(min(primitive.v[0].x, primitive.v[1].x), primitive.v[2].x)));
+  int pxEnd = min(x1 - 1, (int)ceil(max(max(primitive.v[0].x, primitive.v[1].x), primitive.v[2].x)));
+  int pyStart = max(y0, (int)floor(min(min(primitive.v[0].y, primitive.v[1].y), primitive.v[2].y)));
+  int pyEnd = min(y1 - 1, (int)ceil(max(max(primitive.v[0].y, primitive.v[1].y), primitive.v[2].y)));
+  if(pxStart > pxEnd || pyStart > pyEnd){
+    return;
+  }
+  long long cx = (long long)pxStart * SOFTWARE_SUBPIXEL + SOFTWARE_SUBPIXEL / 2;
+  long long cy = (long long)pyStart * SOFTWARE_SUBPIXEL + SOFTWARE_SUBPIXEL / 2;
+
+  bool fits = true;  // every value stays in 32 bits, the SSE2 path can be used
+  for(int i = 0; i < 3; i++){
+    int a = order[(i + 1) % 3], b = order[(i + 2) % 3];
+    long long dx = X[b] - X[a], dy = Y[b] - Y[a];
+    stepX[i] = -dy * SOFTWARE_SUBPIXEL;
+    stepY[i] = dx * SOFTWARE_SUBPIXEL;
+    rowStart[i] = dx * (cy - Y[a]) - dy * (cx - X[a]);
+    bias[i] = (dy < 0 || (dy == 0 && dx > 0)) ? 1 : 0;  // left and bottom edges own their pixels, top-left with y down
+
+    long long width = pxEnd - pxStart + 1, height = pyEnd - pyStart + 1;
+    long long largest = llabs(rowStart[i]) + llabs(stepX[i]) * (width + 4) + llabs(stepY[i]) * height;
+    fits = fits && largest < (1LL << 30);
+  }
+
+  float inverseArea = 1.0f / area;
+  const SoftwarePrimitive ordered = { false, primitive.flat,
+    { primitive.v[order[0]], primitive.v[order[1]], primitive.v[order[2]] } };
+
+  for(int py = pyStart; py <= pyEnd; py++){
+    long long e0 = rowStart[0], e1 = rowStart[1], e2 = rowStart[2];
+    int px = pxStart;
+
+#if defined(__SSE2__)
+    if(fits){
+      __m128i zero = _mm_setzero_si128();
+      __m128i E0 = _mm_add_epi32(_mm_set1_epi32((int)(e0 + bias[0])), _mm_setr_epi32(0, (int)stepX[0], (int)(2 * stepX[0]), (int)(3 * stepX[0])));
+      __m128i E1 = _mm_add_epi32(_mm_set1_epi32((int)(e1 + bias[1])), _mm_setr_epi32(0, (int)stepX[1], (int)(2 * stepX[1]), (int)(3 * stepX[1])));
+      __m128i E2 = _mm_add_epi32(_mm_set1_epi32((int)(e2 + bias[2])), _mm_setr_epi32(0, (int)stepX[2], (int)(2 * stepX[2]), (int)(3 * stepX[2])));
+      __m128i step0 = _mm_set1_epi32((int)(4 * stepX[0]));
+      __m128i step1 = _mm_set1_epi32((int)(4 * stepX[1]));
+      __m128i step2 = _mm_set1_epi32((int)(4 * stepX[2]));
+
+      for(; px + 3 <= pxEnd; px += 4){
+        __m128i inside = _mm_and_si128(_mm_and_si128(_mm_cmpgt_epi32(E0, zero), _mm_cmpgt_epi32(E1, zero)), _mm_cmpgt_epi32(E2, zero));
+        int mask = _mm_movemask_ps(_mm_castsi128_ps(inside));
+        for(int lane = 0; mask; lane++, mask >>= 1){
+          if(mask & 1){
+            writeSoftwarePixel(ordered, px + lane, py, (e0 + lane * stepX[0]) * inverseArea,
+                               (e1 + lane * stepX[1]) * inverseArea, (e2 + lane * stepX[2]) * inverseArea);
+          }
+        }
+        E0 = _mm_add_epi32(E0, step0);
+        E1 = _mm_add_epi32(E1, step1);
+        E2 = _mm_add_epi32(E2, step2);
+        e0 += 4 * stepX[0];
+        e1 += 4 * stepX[1];
+        e2 += 4 * stepX[2];
+      }
+    }
+#endif
+
+    // scalar : the end of the row, or everything without SSE2 or with huge triangles
+    for(; px <= pxEnd; px++){
+      if(e0 + bias[0] > 0 && e1 + bias[1] > 0 && e2 + bias[2] > 0){
+        writeSoftwarePixel(ordered, px, py, e0 * inverseArea, e1 * inverseArea, e2 * inverseArea);
+      }
+      e0 += stepX[0];
+      e1 += stepX[1];
+      e2 += stepX[2];
+    }
+
+    for(int i = 0; i < 3; i++){
+      rowStart[i] += stepY[i];
+    }
+  }
+}
+
+// one line inside the tile, one pixel per step along its major axis
+void rasterizeSoftwareLine (const SoftwarePrimitive &primitive, int x0, int y0, int x1, int y1){
+  const SoftwareVertex &a = primitive.v[0], &b = primitive.v[1];
+  float dx = b.x - a.x, dy = b.y - a.y;
+  int steps = max(1, (int)(max(fabs(dx), fabs(dy)) + 0.5f));
+  for(int i = 0; i < steps; i++){
+    float t = (i + 0.5f) / steps;
+    int px = (int)ceil(a.x + t * dx) - 1, py = (int)ceil(a.y + t * dy) - 1;  // points on a pixel edge go left and down
+    if(px >= x0 && px < x1 && py >= y0 && py < y1){
+      writeSoftwarePixel(primitive, px, py, 1 - t, t, 0);
+    }
+  }
+}
+
+// clear and draw tiles until none are left, run by every worker thread
+void rasterizeSoftwareTiles (){
+  GLubyte clear[3];
+  for(int i = 0; i < 3; i++){
+    clear[i] = (GLubyte)(Software.clearColor[i] * 255 + 0.5f);
+  }
+
+  for(int tile = Software.nextTile++; tile < Software.tilesX * Software.tilesY; tile = Software.nextTile++){
+    int x0 = (tile % Software.tilesX) * SOFTWARE_TILE, y0 = (tile / Software.tilesX) * SOFTWARE_TILE;
+    int x1 = min(x0 + SOFTWARE_TILE, Software.width), y1 = min(y0 + SOFTWARE_TILE, Software.height);
+
+    for(int y = y0; y < y1; y++){
+      for(int x = x0; x < x1; x++){
+        int index = y * Software.width + x;
+        Software.depth[index] = 1;
+        memcpy(&Software.color[3 * index], clear, 3);
+      }
+    }
+
+    vector<int> &bin = Software.bins[tile];
+    for(size_t i = 0; i < bin.size(); i++){
+      const SoftwarePrimitive &primitive = Software.primitives[bin[i]];
+      if(primitive.line){
+        rasterizeSoftwareLine(primitive, x0, y0, x1, y1);
+      }
+      else {
+        rasterizeSoftwareTriangle(primitive, x0, y0, x1, y1);
+      }
+    }
+  }
+}
+
+// worker : rasterize tiles each time a frame is handed over, until told to stop
+void softwareWorker (){
+  int seen = 0;
+  while(true){
+    {
+      unique_lock<mutex> guard(Software.lock);
+      Software.start.wait(guard, [&seen]{ return Software.stopping || Software.frame != seen; });
+      if(Software.stopping){
+        return;
+      }
+      seen = Software.frame;
+    }
+    rasterizeSoftwareTiles();
+    {
+      lock_guard<mutex> guard(Software.lock);
+      Software.working--;
+    }
+    Software.done.notify_one();
+  }
+}
+
+// the workers live as long as the backend, a frame only wakes them up
+void startSoftwareWorkers (){
+  Software.frame = 0;
+  Software.working = 0;
+  Software.stopping = false;
+  for(int i = 1; i < Software.threads; i++){
+    Software.workers.push_back(thread(softwareWorker));
+  }
+}
+
+void stopSoftwareWorkers (){
+  {
+    lock_guard<mutex> guard(Software.lock);
+    Software.stopping = true;
+  }
+  Software.start.notify_all();
+  for(size_t i = 0; i < Software.workers.size(); i++){
+    Software.workers[i].join();
+  }
+  Software.workers.clear();
+}
+
+// rasterize the frame's bins; tiles never share pixels, so the image does not depend on the thread count
+void finishSoftwareFrame (){
+  Software.nextTile = 0;
+  {
+    lock_guard<mutex> guard(Software.lock);
+    Software.working = Software.workers.size();
+    Software.frame++;
+  }
+  Software.start.notify_all();
+  rasterizeSoftwareTiles();
+
+  unique_lock<mutex> guard(Software.lock);
+  Software.done.wait(guard, []{ return Software.working == 0; });
+}
+
 bool fired = GL_FALSE;
 
 /* Render the VBOs handled by VAO */
 void draw3DObject (struct VAO* vao){
-    // Change the Fill Mode for this object
-    glPolygonMode (GL_FRONT_AND_BACK, vao->FillMode);
+    if(renderingInSoftware()){
+      // binned now, rasterized by finishSoftwareFrame()
+      rasterize3DObject (vao);
+      Stats.drawCalls++;
+      Stats.vertices += vao->NumVertices;
+      return;
+    }
 
-    // Bind the VAO to use
-    glBindVertexArray (vao->VertexArrayID);
+    // Change the Fill Mode for this object
+    setPolygonMode (vao->FillMode);
 
-    // Enable Vertex Attribute 0 - 3d Vertices
-    glEnableVertexAttribArray(0);
-    // Bind the VBO to use
-    glBindBuffer(GL_ARRAY_BUFFER, vao->VertexBuffer);
+    // Bind the VAO to use, it already knows which VBOs feed its attributes
+    bindVertexArray (vao->VertexArrayID);
 
-    // Enable Vertex Attribute 1 - Color
-    glEnableVertexAttribArray(1);
-    // Bind the VBO to use
-    glBindBuffer(GL_ARRAY_BUFFER, vao->ColorBuffer);
+    // Enable Vertex Attribute 0 - 3d Vertices and 1 - Color
+    enableVertexAttributes (vao);
 
     // Draw the geometry !
     glDrawArrays(vao->PrimitiveMode, 0, vao->NumVertices); // Starting from vertex 0; 3 vertices total -> 1 triangle
+
+    Stats.drawCalls++;
+    Stats.vertices += vao->NumVertices;
 }
 
-/* Executed when window is resized to 'width' and 'height' */
+int framebufferWidth = 600, framebufferHeight = 600;  // pixels, updated by resizeFramebuffer()
+
+/* Executed when the framebuffer is 'fbwidth' x 'fbheight' pixels */
 /* Modify the bounds of the screen here in glm::ortho or Field of View in glm::Perspective */
-void reshapeWindow (GLFWwindow* window, int width, int height){
-    int fbwidth=width, fbheight=height;
-    /* With Retina display on Mac OS X, GLFW's FramebufferSize
-     is different from WindowSize */
-    glfwGetFramebufferSize(window, &fbwidth, &fbheight);
+void resizeFramebuffer (int fbwidth, int fbheight){
+    framebufferWidth = fbwidth;
+    framebufferHeight = fbheight;
 
 	  GLfloat fov = 90.0f;
 
 	  // sets the viewport of openGL renderer
-	  glViewport (0, 0, (GLsizei) fbwidth, (GLsizei) fbheight);
+	  if(!renderingInSoftware()){
+	    glViewport (0, 0, (GLsizei) fbwidth, (GLsizei) fbheight);
+	  }
 
 	  // set the projection matrix as perspective
 	  
@@ -226,6 +976,17 @@ void reshapeWindow (GLFWwindow* window, int width, int height){
     Matrices.projection = glm::ortho(-4.0f, 4.0f, -4.0f, 4.0f, 0.1f, 500.0f);
 }
 
+#ifdef USE_GLFW
+/* Executed when window is resized to 'width' and 'height' */
+void reshapeWindow (GLFWwindow* window, int width, int height){
+    int fbwidth=width, fbheight=height;
+    /* With Retina display on Mac OS X, GLFW's FramebufferSize
+     is different from WindowSize */
+    glfwGetFramebufferSize(window, &fbwidth, &fbheight);
+    resizeFramebuffer(fbwidth, fbheight);
+}
+#endif
+
 float camera_rotation_angle = 90;
 
 VAO* createPolygon (float radius, int sides, GLfloat red, GLfloat green, GLfloat blue){
@@ -264,6 +1025,46 @@ VAO* createPolygon (float radius, int sides, GLfloat red, GLfloat green, GLfloat
   }
   return create3DObject(GL_TRIANGLES, sides * 3, vertex_buffer_data, red, blue, green, GL_FILL);
 }
+
+/* Polygon as a triangle fan: center, then the rim closed back on itself */
+/* sides + 2 vertices instead of the sides * 3 of createPolygon() */
+VAO* createPolygonFan (float radius, int sides, GLfloat red, GLfloat green, GLfloat blue){
+  vector<GLfloat> vertex_buffer_data (3 * (sides + 2), 0.0);  // first vertex stays at (0, 0, 0)
+
+  double baseAngle = 2 * M_PI/sides;
+  for(int i = 1; i <= sides + 1; i++)
+  {
+    vertex_buffer_data[3*i + 0] = radius * cos(baseAngle * i);
+    vertex_buffer_data[3*i + 1] = radius * sin(baseAngle * i);
+  }
+  return create3DObject(GL_TRIANGLE_FAN, sides + 2, &vertex_buffer_data[0], red, green, blue, GL_FILL);
+}
+
+map<int, VAO*> meshCache;  // unit radius white polygon per side count, shared by all objects
+long meshCacheBytes = 0;   // vertex and color VBO memory held by the cache
+
+/* Get the shared unit polygon for this many sides, created on first use */
+/* Radius, color and transform are supplied per draw */
+VAO* getPolygonMesh (int sides){
+  map<int, VAO*> :: iterator it = meshCache.find(sides);
+  if(it != meshCache.end()){
+    return it->second;
+  }
+  VAO* mesh;
+  if(Options.fanPolygons){
+    mesh = createPolygonFan(1.0, sides, 1, 1, 1);
+  }
+  else {
+    mesh = createPolygon(1.0, sides, 1, 1, 1);
+  }
+  meshCache[sides] = mesh;
+
+  meshCacheBytes += 2 * 3 * mesh->NumVertices * sizeof(GLfloat);
+  if(Options.stats){
+    cout << "mesh : " << sides << " sides, " << mesh->NumVertices << " vertices, cache " << meshCacheBytes << " bytes" << endl;
+  }
+  return mesh;
+}
   
 
 class CoordinateVector {
@@ -298,156 +1099,479 @@ class CoordinateVector {
     }
 };
 
+bool staticSceneDirty = true;  // a static object changed since the static layer was drawn
+
+/* Fixed timestep : the game advances in steps of 1 / Options.stepRate seconds whatever the display */
+/* rate, and objects are drawn blended between their states before and after the last step */
+const double SIM_TICK_RATE = 60;  // steps per second the motion constants were tuned for
+
+struct SimulationClock {
+    double accumulator;  // seconds of real time not simulated yet
+    double lastTime;     // when the clock was last advanced
+    bool started;
+    float alpha;         // where the drawn frame lies between the previous step (0) and the last one (1)
+} Simulation;
+
+/* Body store : the moving state of every GameObject, kept as structure of arrays so one SIMD */
+/* kernel integrates all bodies in a pass instead of visiting map nodes one at a time. The game */
+/* is 2D, only x and y move; z stays in the object as a fixed depth offset */
+enum BodyFlags { BODY_STATIC = 1, BODY_BATCH_DIRTY = 2, BODY_LIVE = 4, BODY_PROBE = 8 };
+
+struct BodyStore {
+    vector<float> x, y, vx, vy, ax, ay;
+    vector<float> radius;          // circumcircle, the bounds the broadphase works with
+    vector<float> px, py;          // positions at the start of the step, drawn frames blend from them
+    vector<float> angle, pangle;   // rotationValue, and its value at the start of the step
+    vector<float> tint;            // tint amount, fades every step
+    vector<unsigned char> flags;   // BodyFlags
+    vector<int> freeSlots;
+    int generation;                // bumped whenever a slot is claimed or released
+} Bodies;
+
+int claimBody(){
+  Bodies.generation++;
+  if(!Bodies.freeSlots.empty()){
+    int slot = Bodies.freeSlots.back();
+    Bodies.freeSlots.pop_back();
+    Bodies.flags[slot] = BODY_LIVE;
+    return slot;
+  }
+  vector<float>* arrays[] = { &Bodies.x, &Bodies.y, &Bodies.vx, &Bodies.vy, &Bodies.ax, &Bodies.ay, &Bodies.radius,
+                              &Bodies.px, &Bodies.py, &Bodies.angle, &Bodies.pangle, &Bodies.tint };
+  for(vector<float>* array : arrays){
+    array->push_back(0);
+  }
+  Bodies.flags.push_back(BODY_LIVE);
+  return Bodies.x.size() - 1;
+}
+
+// a free slot is a body at rest, the kernel can run over it without checking
+void releaseBody(int slot){
+  vector<float>* arrays[] = { &Bodies.x, &Bodies.y, &Bodies.vx, &Bodies.vy, &Bodies.ax, &Bodies.ay, &Bodies.radius,
+                              &Bodies.px, &Bodies.py, &Bodies.angle, &Bodies.pangle, &Bodies.tint };
+  for(vector<float>* array : arrays){
+    (*array)[slot] = 0;
+  }
+  Bodies.flags[slot] = 0;
+  Bodies.freeSlots.push_back(slot);
+  Bodies.generation++;
+}
+
+/* A GameObject's slot in the body store. Only one handle owns a slot : moving hands it */
+/* over and leaves -1 behind, copying is not allowed so two objects never share a body */
+struct BodyHandle {
+    int slot;
+    BodyHandle(){
+      slot = claimBody();
+    }
+    BodyHandle(const BodyHandle &other) = delete;
+    BodyHandle& operator = (const BodyHandle &other) = delete;
+    BodyHandle(BodyHandle &&other){
+      slot = other.slot;
+      other.slot = -1;
+    }
+    BodyHandle& operator = (BodyHandle &&other){
+      if(this != &other){
+        if(slot != -1){
+          releaseBody(slot);
+        }
+        slot = other.slot;
+        other.slot = -1;
+      }
+      return *this;
+    }
+    ~BodyHandle(){
+      if(slot != -1){
+        releaseBody(slot);
+      }
+    }
+};
+
+// the start of a step, drawn frames blend from here
+void saveBodies(){
+  Bodies.px = Bodies.x;
+  Bodies.py = Bodies.y;
+  Bodies.pangle = Bodies.angle;
+}
+
+#if defined(USE_AVX_DISPATCH)
+// integrateBodies() 8 bodies at a time, only called when the CPU has AVX; returns how many it did
+__attribute__((target("avx")))
+int integrateBodiesAVX(float *x, float *y, float *vx, float *vy, const float *ax, const float *ay, float *tint, int n, float ticks, float fade){
+  int i = 0;
+  __m256 step8 = _mm256_set1_ps(ticks), wall8 = _mm256_set1_ps(-4), sign8 = _mm256_set1_ps(-0.0f);
+  __m256 fade8 = _mm256_set1_ps(fade), faint8 = _mm256_set1_ps(0.01f);
+  for(; i + 8 <= n; i += 8){
+    __m256 nvx = _mm256_add_ps(_mm256_loadu_ps(vx + i), _mm256_mul_ps(_mm256_loadu_ps(ax + i), step8));
+    __m256 nvy = _mm256_add_ps(_mm256_loadu_ps(vy + i), _mm256_mul_ps(_mm256_loadu_ps(ay + i), step8));
+    __m256 nx = _mm256_add_ps(_mm256_loadu_ps(x + i), _mm256_mul_ps(nvx, step8));
+    __m256 ny = _mm256_add_ps(_mm256_loadu_ps(y + i), _mm256_mul_ps(nvy, step8));
+    nvx = _mm256_xor_ps(nvx, _mm256_and_ps(_mm256_cmp_ps(nx, wall8, _CMP_LE_OQ), sign8));
+    __m256 t = _mm256_loadu_ps(tint + i);
+    t = _mm256_and_ps(_mm256_mul_ps(t, fade8), _mm256_cmp_ps(t, faint8, _CMP_GT_OQ));
+    _mm256_storeu_ps(vx + i, nvx);
+    _mm256_storeu_ps(vy + i, nvy);
+    _mm256_storeu_ps(x + i, nx);
+    _mm256_storeu_ps(y + i, ny);
+    _mm256_storeu_ps(tint + i, t);
+  }
+  return i;
+}
+#endif
+
+// one step of every body : v += a t, x += v t, bounce off the left wall and fade the tints
+void integrateBodies(float ticks){
+  int n = Bodies.x.size();
+
+  // scenery that moves or fades has to be drawn again, checked 8 flags at a time
+  for(int i = 0; i < n; i += 8){
+    unsigned long long word = 0;
+    memcpy(&word, &Bodies.flags[i], min(8, n - i));
+    if(!(word & 0x0101010101010101ull * BODY_STATIC)){
+      continue;
+    }
+    for(int j = i; j < min(i + 8, n); j++){
+      if((Bodies.flags[j] & BODY_STATIC) && (Bodies.vx[j] || Bodies.vy[j] || Bodies.ax[j] || Bodies.ay[j] || Bodies.tint[j] > 0)){
+        Bodies.flags[j] |= BODY_BATCH_DIRTY;
+        staticSceneDirty = true;
+      }
+    }
+  }
+
+  float *x = Bodies.x.data(), *y = Bodies.y.data(), *vx = Bodies.vx.data(), *vy = Bodies.vy.data();
+  float *ax = Bodies.ax.data(), *ay = Bodies.ay.data(), *tint = Bodies.tint.data();
+  float fade = pow(0.85, ticks);  // flashes fade out over a few ticks
+  int i = 0;
+#if defined(USE_AVX_DISPATCH)
+  static bool avx = __builtin_cpu_supports("avx");
+  if(avx){
+    i = integrateBodiesAVX(x, y, vx, vy, ax, ay, tint, n, ticks, fade);
+  }
+#endif
+#if defined(__SSE2__)
+  __m128 step4 = _mm_set1_ps(ticks), wall4 = _mm_set1_ps(-4), sign4 = _mm_set1_ps(-0.0f);
+  __m128 fade4 = _mm_set1_ps(fade), faint4 = _mm_set1_ps(0.01f);
+  for(; i + 4 <= n; i += 4){
+    __m128 nvx = _mm_add_ps(_mm_loadu_ps(vx + i), _mm_mul_ps(_mm_loadu_ps(ax + i), step4));
+    __m128 nvy = _mm_add_ps(_mm_loadu_ps(vy + i), _mm_mul_ps(_mm_loadu_ps(ay + i), step4));
+    __m128 nx = _mm_add_ps(_mm_loadu_ps(x + i), _mm_mul_ps(nvx, step4));
+    __m128 ny = _mm_add_ps(_mm_loadu_ps(y + i), _mm_mul_ps(nvy, step4));
+    nvx = _mm_xor_ps(nvx, _mm_and_ps(_mm_cmple_ps(nx, wall4), sign4));
+    __m128 t = _mm_loadu_ps(tint + i);
+    t = _mm_and_ps(_mm_mul_ps(t, fade4), _mm_cmpgt_ps(t, faint4));
+    _mm_storeu_ps(vx + i, nvx);
+    _mm_storeu_ps(vy + i, nvy);
+    _mm_storeu_ps(x + i, nx);
+    _mm_storeu_ps(y + i, ny);
+    _mm_storeu_ps(tint + i, t);
+  }
+#endif
+  for(; i < n; i++){
+    vx[i] += ax[i] * ticks;
+    vy[i] += ay[i] * ticks;
+    x[i] += vx[i] * ticks;
+    y[i] += vy[i] * ticks;
+    if(x[i] <= -4){
+      vx[i] = -vx[i];
+    }
+    tint[i] = tint[i] > 0.01f ? tint[i] * fade : 0;
+  }
+}
+
 class GameObject{
   
-  VAO *drawable;
-  
   int sides;
-  float radius;
 
   float rotationAngle;
-  float rotationValue;
 
-  CoordinateVector position;
-  CoordinateVector velocity;
-  CoordinateVector acceleration;
+  BodyHandle body;  // position, velocity, acceleration, rotationValue and tint amount live in Bodies
+  float z;
+
+  glm::vec3 tint;  // blended over the color by the body's tint amount, for hit flashes and fades
+
+  bool batched;     // baked into the static batch, not drawn on its own
+
+  // a static object looks different now, the static layer has to be drawn again
+  void changed(){
+    if(Bodies.flags[body.slot] & BODY_STATIC){
+      staticSceneDirty = true;
+      Bodies.flags[body.slot] |= BODY_BATCH_DIRTY;
+    }
+  }
   
   public:
     GLfloat red, green, blue;
     int score, value;
     GameObject(float circleRadius = 1, int numberOfSides = 3){
       
-      radius = circleRadius;
+      Bodies.radius[body.slot] = circleRadius;
       sides = numberOfSides;
 
       score = 0;
       value = 0;
 
       rotationAngle = 180.0 / sides;
-      rotationValue = 0;
-      
-      position = CoordinateVector(0, 0, 0);
-      velocity = CoordinateVector(0, 0, 0);
-      acceleration = CoordinateVector(0, 0, 0);
+      z = 0;
       
-      drawable = NULL;
+      batched = false;
       setColors();  // will be initialized with default colors if no arguments are passed
-      createDrawable (radius, sides); // for first time creation of drawable
+      setTint();
     }
 
-    // get radius of the circumcircle
-    float getRadius(){
-      return radius;
+    // is the object part of the scenery
+    bool isStatic(){
+      return Bodies.flags[body.slot] & BODY_STATIC;
     }
 
-    float getRotationAngle(){
-      return rotationAngle;
+    // mark the object as scenery or not
+    void setStatic(bool value){
+      if(value){
+        Bodies.flags[body.slot] |= BODY_STATIC | BODY_BATCH_DIRTY;
+      }
+      else {
+        Bodies.flags[body.slot] = (Bodies.flags[body.slot] & ~BODY_STATIC) | BODY_BATCH_DIRTY;
+      }
+      staticSceneDirty = true;
     }
 
-    void setRotationAngle(float angle){
-      rotationAngle = angle;
+    // static and not moving, can be baked into the static batch
+    bool isImmovable(){
+      int i = body.slot;
+      return isStatic() && !Bodies.vx[i] && !Bodies.vy[i] && !Bodies.ax[i] && !Bodies.ay[i];
     }
 
-    float getRotationValue(){
-      return rotationValue;
+    // is the object drawn as part of the static batch
+    bool isBatched(){
+      return batched;
     }
 
-    void setRotationValue(float angle){
-      rotationValue = angle;
+    void setBatched(bool value){
+      batched = value;
+      Bodies.flags[body.slot] &= ~BODY_BATCH_DIRTY;
     }
 
-    // get position
-    CoordinateVector getPosition(){
-      return position;
+    // do the baked vertices need rewriting
+    bool isBatchDirty(){
+      return Bodies.flags[body.slot] & BODY_BATCH_DIRTY;
     }
 
-    // set position
-    void setPosition(double x = 0, double y = 0, double z = 0){
-      position = CoordinateVector(x, y, z);
+    // get radius of the circumcircle
+    float getRadius(){
+      return Bodies.radius[body.slot];
     }
 
-    // set position from CoordinateVector
+    // slot in the body store
+    int getBody(){
+      return body.slot;
+    }
+
+    // look up contacts every step even when not moving
+    void setProbe(bool value){
+      if(value){
+        Bodies.flags[body.slot] |= BODY_PROBE;
+      }
+      else {
+        Bodies.flags[body.slot] &= ~BODY_PROBE;
+      }
+    }
+
+    // get number of sides of the polygon
+    int getSides(){
+      return sides;
+    }
+
+    float getRotationAngle(){
+      return rotationAngle;
+    }
+
+    void setRotationAngle(float angle){
+      rotationAngle = angle;
+      changed();
+    }
+
+    float getRotationValue(){
+      return Bodies.angle[body.slot];
+    }
+
+    // jump to an angle, drawn there at once
+    void setRotationValue(float angle){
+      Bodies.angle[body.slot] = Bodies.pangle[body.slot] = angle;
+      changed();
+    }
+
+    // spin by an angle, drawn turning smoothly over the step
+    void rotate(float angle){
+      Bodies.angle[body.slot] += angle;
+      changed();
+    }
+
+    // get the angle to draw with, between the last two steps
+    float getDrawRotationValue(){
+      int i = body.slot;
+      return Bodies.pangle[i] + (Bodies.angle[i] - Bodies.pangle[i]) * Simulation.alpha;
+    }
+
+    // get position
+    CoordinateVector getPosition(){
+      return CoordinateVector(Bodies.x[body.slot], Bodies.y[body.slot], z);
+    }
+
+    // get the position to draw at, between the last two steps
+    CoordinateVector getDrawPosition(){
+      int i = body.slot;
+      return CoordinateVector(Bodies.px[i] + (Bodies.x[i] - Bodies.px[i]) * Simulation.alpha,
+                              Bodies.py[i] + (Bodies.y[i] - Bodies.py[i]) * Simulation.alpha, z);
+    }
+
+    // set position, a jump drawn there at once
+    void setPosition(double x = 0, double y = 0, double z = 0){
+      Bodies.x[body.slot] = Bodies.px[body.slot] = x;
+      Bodies.y[body.slot] = Bodies.py[body.slot] = y;
+      GameObject::z = z;
+      changed();
+    }
+
+    // set position from CoordinateVector
     void setPosition(CoordinateVector one){
-      position = one;
+      setPosition(one.x, one.y, one.z);
     }
 
     // get velocity
     CoordinateVector getVelocity(){
-      return velocity;
+      return CoordinateVector(Bodies.vx[body.slot], Bodies.vy[body.slot], 0);
     }
 
-    // set velocity
-    void setVelocity(double x = 0, double y = 0, double z = 0){
-      velocity = CoordinateVector(x, y, z);
+    // set velocity, the body store is flat so there is no z
+    void setVelocity(double x = 0, double y = 0){
+      Bodies.vx[body.slot] = x;
+      Bodies.vy[body.slot] = y;
+      changed();
     }
 
     // set velocity from CoordinateVector
     void setVelocity(CoordinateVector one){
-      velocity = one;
+      setVelocity(one.x, one.y);
     }
 
     // get acceleration
     CoordinateVector getAcceleration(){
-      return acceleration;
-    }
-
-    // set acceleration
-    void setAcceleration(double x = 0, double y = 0, double z = 0){
-      acceleration = CoordinateVector(x, y, z);
-    }
-
-    // will set radius and sides of the object when called for the first time
-    void createDrawable(float circleRadius, int numberOfSides){
-      drawable = createPolygon (circleRadius, numberOfSides, red, green, blue); // with default or first time values passed into
+      return CoordinateVector(Bodies.ax[body.slot], Bodies.ay[body.slot], 0);
     }
 
-    // create the object ready to be drawn
-    void updateDrawable(){
-      drawable = createPolygon (radius, sides, red, green, blue); // with updated values
+    // set acceleration, flat like the velocity
+    void setAcceleration(double x = 0, double y = 0){
+      Bodies.ax[body.slot] = x;
+      Bodies.ay[body.slot] = y;
+      changed();
     }
 
-
     // set the colors of object
     void setColors(GLfloat r = 0, GLfloat g = 0, GLfloat b = 0){
       red = r;
       green = g;
       blue = b;
-      if(drawable) { // if drawable exists then update it with new colors
-        updateDrawable();
-      }
+      changed();
+    }
+
+    // get the color to draw with; createPolygon() always passed colors in r, b, g order, keep the same look
+    glm::vec3 getDrawColor(){
+      return glm::vec3(red, blue, green);
+    }
+
+    // set the tint blended over the colors, amount 0 leaves the colors as they are
+    void setTint(GLfloat r = 1, GLfloat g = 1, GLfloat b = 1, GLfloat amount = 0){
+      tint = glm::vec3(r, g, b);
+      Bodies.tint[body.slot] = amount;
+      changed();
+    }
+
+    // get the tint, applied per draw without touching the mesh
+    glm::vec4 getTint(){
+      return glm::vec4(tint, Bodies.tint[body.slot]);
     }
 
-    // get the object ready to be drawn
+    // get the shared unit mesh, scaled by radius when drawn
     VAO* getDrawable(){
-      return drawable;
+      return getPolygonMesh(sides);
     }
 
     // change velocity of the object
     void changeVelocity(CoordinateVector change){
-      velocity = velocity + change; // the '+' used here is defined in CoordinateVector Class
+      setVelocity(Bodies.vx[body.slot] + change.x, Bodies.vy[body.slot] + change.y);
     }
 
     // change acceleration of the object
     void changeAcceleration(CoordinateVector change){
-      acceleration = acceleration + change; // the '+' used here is defined in CoordinateVector Class
-    }
-
-    // update state of the object: keep updating velocity till we have acceleration and position till we have velocity
-    void updateState(){
-      //cout<<"position : "<<position.x<<" "<<position.y<<" "<<position.z<<endl;
-      //mcout<<"velocity : "<<velocity.x<<" "<<velocity.y<<" "<<velocity.z<<endl;
-      velocity = velocity + acceleration; 
-      position = position + velocity;
-      if(position.x <= -4){
-        velocity.x = -1 * velocity.x;
-      }
+      setAcceleration(Bodies.ax[body.slot] + change.x, Bodies.ay[body.slot] + change.y);
     }
 };
 
+/* Lines queued during a frame, streamed into one ring buffer and drawn with one call */
+struct LineBatcher {
+    VAO* drawable;          // persistent VAO over the ring buffers, created once in initLines()
+    int Capacity;           // vertices the ring buffers can hold
+    int Offset;             // first free vertex in the ring
+
+    vector<GLfloat> vertices;
+    vector<GLfloat> colors;
+} Lines;
+
+void initLines(int capacity){
+  Lines.Capacity = capacity;
+  Lines.Offset = 0;
+
+  Lines.drawable = new struct VAO;
+  Lines.drawable->PrimitiveMode = GL_LINES;
+  Lines.drawable->FillMode = GL_LINE;
+  Lines.drawable->NumVertices = 0;
+  Lines.drawable->AttributesEnabled = false;
+  if(renderingInSoftware()){
+    Lines.drawable->VertexArrayID = Lines.drawable->VertexBuffer = Lines.drawable->ColorBuffer = 0;
+    return;
+  }
+
+  glGenVertexArrays(1, &(Lines.drawable->VertexArrayID));
+  glGenBuffers (1, &(Lines.drawable->VertexBuffer));
+  glGenBuffers (1, &(Lines.drawable->ColorBuffer));
+
+  bindVertexArray (Lines.drawable->VertexArrayID);
+  bindArrayBuffer (Lines.drawable->VertexBuffer);
+  glBufferData (GL_ARRAY_BUFFER, 3*capacity*sizeof(GLfloat), NULL, GL_STREAM_DRAW);
+  bindArrayBuffer (Lines.drawable->ColorBuffer);
+  glBufferData (GL_ARRAY_BUFFER, 3*capacity*sizeof(GLfloat), NULL, GL_STREAM_DRAW);
+}
+
+// append one line in world space; depth orders it against the models
+void queueLine(const GLfloat vertex_buffer_data[], const GLfloat color_buffer_data[], float depth){
+  for(int i = 0; i < 6; i++){
+    Lines.vertices.push_back(i % 3 == 2 ? depth : vertex_buffer_data[i]);
+    Lines.colors.push_back(color_buffer_data[i]);
+  }
+}
+
+// copy queued data into the ring at the current offset without waiting for the GPU
+void streamToRing(GLuint attribute, GLuint buffer, vector<GLfloat> &data, bool orphan){
+  bindArrayBuffer (buffer);
+  if(orphan){
+    glBufferData (GL_ARRAY_BUFFER, 3*Lines.Capacity*sizeof(GLfloat), NULL, GL_STREAM_DRAW);
+  }
+  GLintptr offset = 3*Lines.Offset*sizeof(GLfloat);
+  GLsizeiptr size = data.size()*sizeof(GLfloat);
+  void* ring = glMapBufferRange(GL_ARRAY_BUFFER, offset, size, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_RANGE_BIT | GL_MAP_UNSYNCHRONIZED_BIT);
+  if(ring){
+    memcpy(ring, &data[0], size);
+    glUnmapBuffer(GL_ARRAY_BUFFER);
+  }
+  else {
+    // the driver refused the mapping, copy the plain way instead
+    glBufferSubData(GL_ARRAY_BUFFER, offset, size, &data[0]);
+  }
+  glVertexAttribPointer(attribute, 3, GL_FLOAT, GL_FALSE, 0, (void*)offset);
+}
+
 class LineObject {
   
   public:
-    VAO* drawable;
     GLfloat vertex_buffer_data[6] = {0, 0, 0, 0, 0, 0};
     GLfloat color_buffer_data[6] = {0, 0, 0, 0, 0, 0};
     
@@ -456,19 +1580,11 @@ class LineObject {
         LineObject::vertex_buffer_data[i] = vertex_buffer_data[i];
         LineObject::color_buffer_data[i] = color_buffer_data[i];
       }
-      createDrawable();
-    }
-    
-    VAO* getDrawable(){
-      return drawable;
     }
 
-    void createDrawable(){
-      drawable = create3DObject(GL_LINES, 2, vertex_buffer_data, color_buffer_data, GL_LINE);
-    }
-
-    void updateDrawable(){
-      drawable = create3DObject(GL_LINES, 2, vertex_buffer_data, color_buffer_data, GL_LINE);
+    // add the line to this frame's batch, drawn by flushLines()
+    void queue(float depth = 0){
+      queueLine(vertex_buffer_data, color_buffer_data, depth);
     }
 
     void setVertexBufferData(GLfloat vertex_buffer_data[]){
@@ -488,7 +1604,7 @@ class LineObject {
 
 map<string, GameObject> allGameObjects;  // dictionary containing all game objects
 
-bool CheckCollision(GameObject one, GameObject two) {
+bool CheckCollision(GameObject &one, GameObject &two) {
   double currentDistance = sqrt( pow((one.getPosition().x - two.getPosition().x), 2) + pow((one.getPosition().y - two.getPosition().y), 2));  // length of line joining the centres
 
   double actualDistance = one.getRadius() + two.getRadius();  // sum of radii of circumcircles of both VAO Objects 
@@ -497,6 +1613,619 @@ bool CheckCollision(GameObject one, GameObject two) {
   return currentDistance <= actualDistance; 
 }
 
+/* Broadphase : finds the pairs of bodies whose circumcircles' bounding boxes overlap, for every */
+/* moving body and for probes such as the player. Each level picks the kind that suits its layout */
+enum BroadphaseKind { BROADPHASE_AUTO, BROADPHASE_GRID, BROADPHASE_SWEEP, BROADPHASE_TREE };
+
+int levelBroadphase = BROADPHASE_GRID;  // set by createAllObjects() for the level it builds
+
+struct BodyPair {
+    int one, two;  // body slots
+};
+
+/* Grid : bodies are bucketed by the cells their bounds cover, in a spatial hash rebuilt with a */
+/* counting sort every step, and only bodies sharing a cell are compared */
+struct SpatialHash {
+    vector<int> cellStart;   // first entry of every bucket, one more than there are buckets
+    vector<int> entries;     // cells, indices into cellX / cellY / cellSlot, grouped by bucket
+    vector<int> cellX, cellY, cellSlot;  // every cell covered by every body, before sorting
+    int buckets;             // a power of two
+} Grid;
+
+/* Which GameObject owns each body slot, rebuilt after objects are added or removed */
+struct BodyIndex {
+    vector<GameObject*> objects;
+    vector<const string*> names;
+    int generation;  // Bodies.generation it was built at
+} Owners;
+
+void indexBodies(){
+  if(Owners.generation == Bodies.generation && Owners.objects.size() == Bodies.x.size()){
+    return;
+  }
+  Owners.objects.assign(Bodies.x.size(), NULL);
+  Owners.names.assign(Bodies.x.size(), NULL);
+  for(map<string, GameObject> :: iterator it = allGameObjects.begin(); it != allGameObjects.end(); it++){
+    Owners.objects[it->second.getBody()] = &it->second;
+    Owners.names[it->second.getBody()] = &it->first;
+  }
+  Owners.generation = Bodies.generation;
+}
+
+int gridCell(float coordinate){
+  return (int)floor(coordinate / Options.gridCell);
+}
+
+int gridBucket(int x, int y){
+  return ((unsigned)x * 73856093u ^ (unsigned)y * 19349663u) & (Grid.buckets - 1);
+}
+
+void buildSpatialHash(){
+  Grid.cellX.clear();
+  Grid.cellY.clear();
+  Grid.cellSlot.clear();
+  for(int i = 0; i < (int)Bodies.x.size(); i++){
+    if(!(Bodies.flags[i] & BODY_LIVE)){
+      continue;
+    }
+    float r = Bodies.radius[i];
+    for(int y = gridCell(Bodies.y[i] - r); y <= gridCell(Bodies.y[i] + r); y++){
+      for(int x = gridCell(Bodies.x[i] - r); x <= gridCell(Bodies.x[i] + r); x++){
+        Grid.cellX.push_back(x);
+        Grid.cellY.push_back(y);
+        Grid.cellSlot.push_back(i);
+      }
+    }
+  }
+
+  // twice as many buckets as entries keeps unrelated cells from sharing much
+  Grid.buckets = 64;
+  while(Grid.buckets < 2 * (int)Grid.cellSlot.size()){
+    Grid.buckets *= 2;
+  }
+  Grid.cellStart.assign(Grid.buckets + 1, 0);
+  for(int k = 0; k < (int)Grid.cellSlot.size(); k++){
+    Grid.cellStart[gridBucket(Grid.cellX[k], Grid.cellY[k]) + 1]++;
+  }
+  for(int b = 0; b < Grid.buckets; b++){
+    Grid.cellStart[b + 1] += Grid.cellStart[b];
+  }
+  Grid.entries.resize(Grid.cellSlot.size());
+  vector<int> next(Grid.cellStart.begin(), Grid.cellStart.end() - 1);
+  for(int k = 0; k < (int)Grid.cellSlot.size(); k++){
+    Grid.entries[next[gridBucket(Grid.cellX[k], Grid.cellY[k])]++] = k;
+  }
+}
+
+bool boundsOverlap(int one, int two){
+  float r = Bodies.radius[one] + Bodies.radius[two];
+  return fabs(Bodies.x[one] - Bodies.x[two]) <= r && fabs(Bodies.y[one] - Bodies.y[two]) <= r;
+}
+
+bool bodyMoving(int i){
+  return (Bodies.flags[i] & BODY_PROBE) || Bodies.vx[i] || Bodies.vy[i] || Bodies.ax[i] || Bodies.ay[i];
+}
+
+// candidate pairs with overlapping bounds, each reported once
+void gridPairs(vector<BodyPair> &pairs){
+  buildSpatialHash();
+  for(int i = 0; i < (int)Bodies.x.size(); i++){
+    if(!(Bodies.flags[i] & BODY_LIVE) || !bodyMoving(i)){
+      continue;
+    }
+    float r = Bodies.radius[i];
+    for(int y = gridCell(Bodies.y[i] - r); y <= gridCell(Bodies.y[i] + r); y++){
+      for(int x = gridCell(Bodies.x[i] - r); x <= gridCell(Bodies.x[i] + r); x++){
+        int bucket = gridBucket(x, y);
+        for(int e = Grid.cellStart[bucket]; e < Grid.cellStart[bucket + 1]; e++){
+          // other cells can share the bucket
+          int k = Grid.entries[e];
+          if(Grid.cellX[k] != x || Grid.cellY[k] != y){
+            continue;
+          }
+          int j = Grid.cellSlot[k];
+          // two moving bodies find each other, the lower slot reports
+          if(j == i || (bodyMoving(j) && j < i) || !boundsOverlap(i, j)){
+            continue;
+          }
+          // the pair shares several cells, report it from the one holding the corner of the overlap
+          float cornerX = max(Bodies.x[i] - r, Bodies.x[j] - Bodies.radius[j]);
+          float cornerY = max(Bodies.y[i] - r, Bodies.y[j] - Bodies.radius[j]);
+          if(gridCell(cornerX) == x && gridCell(cornerY) == y){
+            BodyPair pair = { i, j };
+            pairs.push_back(pair);
+          }
+        }
+      }
+    }
+  }
+}
+
+/* Sweep and prune : the x extents of all bodies stay sorted in one endpoint list. Bodies move */
+/* little between steps, so an insertion sort puts it back in order in near linear time, and */
+/* every swap of a min past a max starts or ends an overlap on x. Each body keeps the bodies it */
+/* overlaps on x, so reporting only looks at the moving ones and checks y */
+struct SweepEndpoint {
+    float value;
+    int slot;
+    bool max;  // right end of the extent, left end when false
+};
+
+struct SweepAndPrune {
+    vector<SweepEndpoint> endpoints;  // sorted by value, a min before a max at the same value
+    vector<vector<int> > overlaps;    // for every slot, the slots it overlaps on x
+    int generation;                   // Bodies.generation the list was built for
+    bool built;
+} Sweep;
+
+void sweepOverlap(int one, int two){
+  Sweep.overlaps[one].push_back(two);
+  Sweep.overlaps[two].push_back(one);
+}
+
+void sweepSeparate(int one, int two){
+  vector<int> &a = Sweep.overlaps[one], &b = Sweep.overlaps[two];
+  a.erase(find(a.begin(), a.end(), two));
+  b.erase(find(b.begin(), b.end(), one));
+}
+
+bool sweepBefore(const SweepEndpoint &one, const SweepEndpoint &two){
+  // touching extents count as overlapping, like boundsOverlap()
+  return one.value < two.value || (one.value == two.value && !one.max && two.max);
+}
+
+float sweepValue(const SweepEndpoint &endpoint){
+  int i = endpoint.slot;
+  return endpoint.max ? Bodies.x[i] + Bodies.radius[i] : Bodies.x[i] - Bodies.radius[i];
+}
+
+// sort from scratch and sweep once to find the overlaps, when bodies come or go
+void rebuildSweep(){
+  Sweep.endpoints.clear();
+  Sweep.overlaps.assign(Bodies.x.size(), vector<int>());
+  for(int i = 0; i < (int)Bodies.x.size(); i++){
+    if(Bodies.flags[i] & BODY_LIVE){
+      SweepEndpoint low = { 0, i, false }, high = { 0, i, true };
+      low.value = sweepValue(low);
+      high.value = sweepValue(high);
+      Sweep.endpoints.push_back(low);
+      Sweep.endpoints.push_back(high);
+    }
+  }
+  sort(Sweep.endpoints.begin(), Sweep.endpoints.end(), sweepBefore);
+
+  vector<int> open;
+  for(SweepEndpoint &endpoint : Sweep.endpoints){
+    if(!endpoint.max){
+      for(int other : open){
+        sweepOverlap(endpoint.slot, other);
+      }
+      open.push_back(endpoint.slot);
+    }
+    else {
+      open.erase(find(open.begin(), open.end(), endpoint.slot));
+    }
+  }
+  Sweep.generation = Bodies.generation;
+  Sweep.built = true;
+}
+
+// move the endpoints to where the bodies are now and sort them back into order
+void updateSweep(){
+  if(!Sweep.built || Sweep.generation != Bodies.generation){
+    rebuildSweep();
+    return;
+  }
+  vector<SweepEndpoint> &list = Sweep.endpoints;
+  for(SweepEndpoint &endpoint : list){
+    endpoint.value = sweepValue(endpoint);
+  }
+  for(int i = 1; i < (int)list.size(); i++){
+    for(int j = i; j > 0 && sweepBefore(list[j], list[j - 1]); j--){
+      SweepEndpoint &moving = list[j], &passed = list[j - 1];
+      if(!moving.max && passed.max){
+        sweepOverlap(moving.slot, passed.slot);   // now starts before the other ends
+      }
+      else if(moving.max && !passed.max){
+        sweepSeparate(moving.slot, passed.slot);  // now ends before the other starts
+      }
+      swap(list[j], list[j - 1]);
+      Stats.sweepSwaps++;
+    }
+  }
+}
+
+void sweepPairs(vector<BodyPair> &pairs){
+  updateSweep();
+  for(int i = 0; i < (int)Sweep.overlaps.size(); i++){
+    if(!(Bodies.flags[i] & BODY_LIVE) || !bodyMoving(i)){
+      continue;
+    }
+    for(int j : Sweep.overlaps[i]){
+      // two moving bodies overlap each other, the lower slot reports
+      if((!bodyMoving(j) || j > i) && boundsOverlap(i, j)){
+        BodyPair pair = { i, j };
+        pairs.push_back(pair);
+      }
+    }
+  }
+}
+
+/* Bounding volume tree : every body's bounds, fattened so small moves don't touch the tree, in */
+/* the leaves of a binary tree kept balanced with rotations. Finds pairs, and answers point and */
+/* area queries, in logarithmic time; it is brought up to date whenever it is asked something */
+const float TREE_MARGIN = 0.1;  // world units the bounds are fattened by
+const float TREE_PREDICT = 4;   // and ticks of motion they are stretched along
+
+struct TreeNode {
+    float minX, minY, maxX, maxY;
+    int parent;          // next free node when the node is free
+    int child1, child2;  // -1 in a leaf
+    int height;          // leaves are 0, free nodes -1
+    int slot;            // body of a leaf
+};
+
+struct AABBTree {
+    vector<TreeNode> nodes;
+    int root;
+    int freeNode;
+    vector<int> leafOf;  // leaf of every body slot, -1 for none
+    int generation;      // Bodies.generation the leaves match
+    bool built;
+} Tree;
+
+bool treeLeaf(int node){
+  return Tree.nodes[node].child1 == -1;
+}
+
+float treePerimeter(const TreeNode &one){
+  return 2 * (one.maxX - one.minX + one.maxY - one.minY);
+}
+
+void treeUnion(TreeNode &target, const TreeNode &one, const TreeNode &two){
+  target.minX = min(one.minX, two.minX);
+  target.minY = min(one.minY, two.minY);
+  target.maxX = max(one.maxX, two.maxX);
+  target.maxY = max(one.maxY, two.maxY);
+}
+
+bool treeOverlap(const TreeNode &node, float minX, float minY, float maxX, float maxY){
+  return node.minX <= maxX && minX <= node.maxX && node.minY <= maxY && minY <= node.maxY;
+}
+
+int allocateTreeNode(){
+  int node = Tree.freeNode;
+  if(node != -1){
+    Tree.freeNode = Tree.nodes[node].parent;
+  }
+  else {
+    Tree.nodes.push_back(TreeNode());
+    node = Tree.nodes.size() - 1;
+  }
+  TreeNode &fresh = Tree.nodes[node];
+  fresh.parent = fresh.child1 = fresh.child2 = fresh.slot = -1;
+  fresh.height = 0;
+  return node;
+}
+
+void freeTreeNode(int node){
+  Tree.nodes[node].parent = Tree.freeNode;
+  Tree.nodes[node].height = -1;
+  Tree.freeNode = node;
+}
+
+// rotate the taller grandchild up when one side of node is more than one level deeper
+int balanceTree(int iA){
+  TreeNode &A = Tree.nodes[iA];
+  if(treeLeaf(iA) || A.height < 2){
+    return iA;
+  }
+  int iB = A.child1, iC = A.child2;
+  TreeNode &B = Tree.nodes[iB], &C = Tree.nodes[iC];
+  int balance = C.height - B.height;
+
+  if(balance > 1){
+    // C takes A's place, A keeps B and the shorter child of C
+    int iF = C.child1, iG = C.child2;
+    TreeNode &F = Tree.nodes[iF], &G = Tree.nodes[iG];
+    C.child1 = iA;
+    C.parent = A.parent;
+    A.parent = iC;
+    if(C.parent == -1){
+      Tree.root = iC;
+    }
+    else if(Tree.nodes[C.parent].child1 == iA){
+      Tree.nodes[C.parent].child1 = iC;
+    }
+    else {
+      Tree.nodes[C.parent].child2 = iC;
+    }
+    if(F.height > G.height){
+      C.child2 = iF;
+      A.child2 = iG;
+      G.parent = iA;
+      treeUnion(A, B, G);
+      treeUnion(C, A, F);
+      A.height = 1 + max(B.height, G.height);
+      C.height = 1 + max(A.height, F.height);
+    }
+    else {
+      C.child2 = iG;
+      A.child2 = iF;
+      F.parent = iA;
+      treeUnion(A, B, F);
+      treeUnion(C, A, G);
+      A.height = 1 + max(B.height, F.height);
+      C.height = 1 + max(A.height, G.height);
+    }
+    return iC;
+  }
+
+  if(balance < -1){
+    // B takes A's place, A keeps C and the shorter child of B
+    int iD = B.child1, iE = B.child2;
+    TreeNode &D = Tree.nodes[iD], &E = Tree.nodes[iE];
+    B.child1 = iA;
+    B.parent = A.parent;
+    A.parent = iB;
+    if(B.parent == -1){
+      Tree.root = iB;
+    }
+    else if(Tree.nodes[B.parent].child1 == iA){
+      Tree.nodes[B.parent].child1 = iB;
+    }
+    else {
+      Tree.nodes[B.parent].child2 = iB;
+    }
+    if(D.height > E.height){
+      B.child2 = iD;
+      A.child1 = iE;
+      E.parent = iA;
+      treeUnion(A, C, E);
+      treeUnion(B, A, D);
+      A.height = 1 + max(C.height, E.height);
+      B.height = 1 + max(A.height, D.height);
+    }
+    else {
+      B.child2 = iE;
+      A.child1 = iD;
+      D.parent = iA;
+      treeUnion(A, C, D);
+      treeUnion(B, A, E);
+      A.height = 1 + max(C.height, D.height);
+      B.height = 1 + max(A.height, E.height);
+    }
+    return iB;
+  }
+  return iA;
+}
+
+// refit the bounds and heights from node up to the root, balancing on the way
+void refitTree(int node){
+  while(node != -1){
+    node = balanceTree(node);
+    TreeNode &parent = Tree.nodes[node];
+    TreeNode &one = Tree.nodes[parent.child1], &two = Tree.nodes[parent.child2];
+    parent.height = 1 + max(one.height, two.height);
+    treeUnion(parent, one, two);
+    node = parent.parent;
+  }
+}
+
+void insertTreeLeaf(int leaf){
+  if(Tree.root == -1){
+    Tree.root = leaf;
+    Tree.nodes[leaf].parent = -1;
+    return;
+  }
+
+  // walk down to the sibling that grows the tree's perimeter least
+  TreeNode box = Tree.nodes[leaf];
+  int index = Tree.root;
+  while(!treeLeaf(index)){
+    TreeNode &node = Tree.nodes[index];
+    TreeNode combined;
+    treeUnion(combined, node, box);
+    float cost = 2 * treePerimeter(combined);
+    float inheritance = 2 * (treePerimeter(combined) - treePerimeter(node));
+
+    float childCost[2];
+    int children[2] = { node.child1, node.child2 };
+    for(int k = 0; k < 2; k++){
+      TreeNode &child = Tree.nodes[children[k]], grown;
+      treeUnion(grown, child, box);
+      childCost[k] = treePerimeter(grown) + inheritance - (treeLeaf(children[k]) ? 0 : treePerimeter(child));
+    }
+    if(cost < childCost[0] && cost < childCost[1]){
+      break;
+    }
+    index = childCost[0] < childCost[1] ? children[0] : children[1];
+  }
+
+  int sibling = index;
+  int oldParent = Tree.nodes[sibling].parent;
+  int newParent = allocateTreeNode();
+  TreeNode &joined = Tree.nodes[newParent];
+  joined.parent = oldParent;
+  treeUnion(joined, Tree.nodes[sibling], box);
+  joined.height = Tree.nodes[sibling].height + 1;
+  joined.child1 = sibling;
+  joined.child2 = leaf;
+  if(oldParent == -1){
+    Tree.root = newParent;
+  }
+  else if(Tree.nodes[oldParent].child1 == sibling){
+    Tree.nodes[oldParent].child1 = newParent;
+  }
+  else {
+    Tree.nodes[oldParent].child2 = newParent;
+  }
+  Tree.nodes[sibling].parent = newParent;
+  Tree.nodes[leaf].parent = newParent;
+  refitTree(newParent);
+}
+
+void removeTreeLeaf(int leaf){
+  if(leaf == Tree.root){
+    Tree.root = -1;
+    return;
+  }
+  int parent = Tree.nodes[leaf].parent;
+  int grandParent = Tree.nodes[parent].parent;
+  int sibling = Tree.nodes[parent].child1 == leaf ? Tree.nodes[parent].child2 : Tree.nodes[parent].child1;
+
+  // the sibling takes the parent's place
+  if(grandParent == -1){
+    Tree.root = sibling;
+    Tree.nodes[sibling].parent = -1;
+    freeTreeNode(parent);
+    return;
+  }
+  if(Tree.nodes[grandParent].child1 == parent){
+    Tree.nodes[grandParent].child1 = sibling;
+  }
+  else {
+    Tree.nodes[grandParent].child2 = sibling;
+  }
+  Tree.nodes[sibling].parent = grandParent;
+  freeTreeNode(parent);
+  refitTree(grandParent);
+}
+
+// the body's bounds, fattened and stretched along its motion
+void fattenTreeLeaf(int leaf, int i){
+  TreeNode &node = Tree.nodes[leaf];
+  float r = Bodies.radius[i] + TREE_MARGIN;
+  float dx = Bodies.vx[i] * TREE_PREDICT, dy = Bodies.vy[i] * TREE_PREDICT;
+  node.minX = Bodies.x[i] - r + min(dx, 0.0f);
+  node.maxX = Bodies.x[i] + r + max(dx, 0.0f);
+  node.minY = Bodies.y[i] - r + min(dy, 0.0f);
+  node.maxY = Bodies.y[i] + r + max(dy, 0.0f);
+}
+
+// bring the leaves up to date : drop gone bodies, add new ones, reinsert those that left their fat bounds
+void updateTree(){
+  if(!Tree.built){
+    Tree.root = Tree.freeNode = -1;
+    Tree.built = true;
+  }
+  if(Tree.generation != Bodies.generation || Tree.leafOf.size() != Bodies.x.size()){
+    Tree.leafOf.resize(Bodies.x.size(), -1);
+    for(int i = 0; i < (int)Bodies.x.size(); i++){
+      bool live = Bodies.flags[i] & BODY_LIVE;
+      if(!live && Tree.leafOf[i] != -1){
+        removeTreeLeaf(Tree.leafOf[i]);
+        freeTreeNode(Tree.leafOf[i]);
+        Tree.leafOf[i] = -1;
+      }
+      else if(live && Tree.leafOf[i] == -1){
+        int leaf = allocateTreeNode();
+        Tree.nodes[leaf].slot = i;
+        fattenTreeLeaf(leaf, i);
+        insertTreeLeaf(leaf);
+        Tree.leafOf[i] = leaf;
+      }
+    }
+    Tree.generation = Bodies.generation;
+  }
+
+  for(int i = 0; i < (int)Bodies.x.size(); i++){
+    int leaf = Tree.leafOf[i];
+    if(leaf == -1){
+      continue;
+    }
+    float r = Bodies.radius[i];
+    TreeNode &node = Tree.nodes[leaf];
+    if(node.minX <= Bodies.x[i] - r && Bodies.x[i] + r <= node.maxX && node.minY <= Bodies.y[i] - r && Bodies.y[i] + r <= node.maxY){
+      continue;
+    }
+    removeTreeLeaf(leaf);
+    fattenTreeLeaf(leaf, i);
+    insertTreeLeaf(leaf);
+    Stats.treeMoves++;
+  }
+}
+
+// bodies whose fat bounds overlap the box
+void queryTree(float minX, float minY, float maxX, float maxY, vector<int> &slots){
+  vector<int> stack;
+  if(Tree.root != -1){
+    stack.push_back(Tree.root);
+  }
+  while(!stack.empty()){
+    int index = stack.back();
+    stack.pop_back();
+    TreeNode &node = Tree.nodes[index];
+    if(!treeOverlap(node, minX, minY, maxX, maxY)){
+      continue;
+    }
+    if(treeLeaf(index)){
+      slots.push_back(node.slot);
+    }
+    else {
+      stack.push_back(node.child1);
+      stack.push_back(node.child2);
+    }
+  }
+}
+
+// bodies whose circumcircle reaches into the circle
+void bodiesWithin(float x, float y, float radius, vector<int> &slots){
+  updateTree();
+  vector<int> candidates;
+  queryTree(x - radius, y - radius, x + radius, y + radius, candidates);
+  for(int i : candidates){
+    float reach = radius + Bodies.radius[i];
+    if(pow(Bodies.x[i] - x, 2) + pow(Bodies.y[i] - y, 2) <= reach * reach){
+      slots.push_back(i);
+    }
+  }
+}
+
+// bodies whose circumcircle holds the point, like what is under the cursor
+void bodiesAt(float x, float y, vector<int> &slots){
+  bodiesWithin(x, y, 0, slots);
+}
+
+void treePairs(vector<BodyPair> &pairs){
+  updateTree();
+  vector<int> candidates;
+  for(int i = 0; i < (int)Bodies.x.size(); i++){
+    if(!(Bodies.flags[i] & BODY_LIVE) || !bodyMoving(i)){
+      continue;
+    }
+    float r = Bodies.radius[i];
+    candidates.clear();
+    queryTree(Bodies.x[i] - r, Bodies.y[i] - r, Bodies.x[i] + r, Bodies.y[i] + r, candidates);
+    for(int j : candidates){
+      // two moving bodies find each other, the lower slot reports
+      if(j != i && (!bodyMoving(j) || j > i) && boundsOverlap(i, j)){
+        BodyPair pair = { i, j };
+        pairs.push_back(pair);
+      }
+    }
+  }
+}
+
+// the broadphase for this level, unless one is asked for
+int broadphaseKind(){
+  return Options.broadphase == BROADPHASE_AUTO ? levelBroadphase : Options.broadphase;
+}
+
+void findPairs(vector<BodyPair> &pairs){
+  pairs.clear();
+  if(broadphaseKind() == BROADPHASE_SWEEP){
+    sweepPairs(pairs);
+  }
+  else if(broadphaseKind() == BROADPHASE_TREE){
+    treePairs(pairs);
+  }
+  else {
+    gridPairs(pairs);
+  }
+  Stats.broadphasePairs += pairs.size();
+}
+
 void increaseSpeed(){
   
   double x = allGameObjects["player"].getPosition().x - 0.1;
@@ -507,6 +2236,7 @@ void increaseSpeed(){
 }
 
 int first = 1;
+#ifdef USE_GLFW
 /* Executed when a regular key is pressed/released/held-down */
 /* Prefered for Keyboard events */
 void keyboard (GLFWwindow* window, int key, int scancode, int action, int mods){
@@ -523,9 +2253,8 @@ void keyboard (GLFWwindow* window, int key, int scancode, int action, int mods){
                   fired = GL_TRUE;
                   allGameObjects["player"].setVelocity( 
                     allGameObjects["cannon4"].getPosition().x * 0.1 - 0.1 * allGameObjects["player"].getPosition().x, 
-                    allGameObjects["cannon4"].getPosition().y * 0.1 - 0.1 * allGameObjects["player"].getPosition().y, 
-                    0);
-                  allGameObjects["player"].setAcceleration(-0.00005 * allGameObjects["player"].getVelocity().x , -0.0006, 0);
+                    allGameObjects["cannon4"].getPosition().y * 0.1 - 0.1 * allGameObjects["player"].getPosition().y);
+                  allGameObjects["player"].setAcceleration(-0.00005 * allGameObjects["player"].getVelocity().x , -0.0006);
                   first = 0;
                 }
                 break;
@@ -561,6 +2290,20 @@ void keyboardChar (GLFWwindow* window, unsigned int key){
   }
 }
 
+// name what is under the cursor, the player aside
+void pickUnderCursor (GLFWwindow* window){
+  double x, y;
+  glfwGetCursorPos(window, &x, &y);
+  vector<int> slots;
+  bodiesAt(x/75.0 - 4, 4.0 - 1.0 * y/75.0, slots);
+  indexBodies();
+  for(int slot : slots){
+    if(Owners.names[slot] && *Owners.names[slot] != "player"){
+      cout << "under cursor : " << *Owners.names[slot] << endl;
+    }
+  }
+}
+
 /* Executed when a mouse button is pressed/released */
 void mouseButton (GLFWwindow* window, int button, int action, int mods){
     switch (button) {
@@ -570,9 +2313,8 @@ void mouseButton (GLFWwindow* window, int button, int action, int mods){
                   fired = GL_TRUE;
                   allGameObjects["player"].setVelocity( 
                     allGameObjects["cannon4"].getPosition().x * 0.1 - 0.1 * allGameObjects["player"].getPosition().x, 
-                    allGameObjects["cannon4"].getPosition().y * 0.1 - 0.1 * allGameObjects["player"].getPosition().y, 
-                    0);
-                  allGameObjects["player"].setAcceleration(-0.00005 * allGameObjects["player"].getVelocity().x , -0.0006, 0);
+                    allGameObjects["cannon4"].getPosition().y * 0.1 - 0.1 * allGameObjects["player"].getPosition().y);
+                  allGameObjects["player"].setAcceleration(-0.00005 * allGameObjects["player"].getVelocity().x , -0.0006);
                   first = 0;
                 }
               }
@@ -580,65 +2322,385 @@ void mouseButton (GLFWwindow* window, int button, int action, int mods){
         case GLFW_MOUSE_BUTTON_RIGHT:
             if (action == GLFW_RELEASE) {
               //allGameObjects["player"].setVelocity(allGameObjects["player"].getVelocity() * -1);
+              pickUnderCursor(window);
             }
             break;
         default:
             break;
     }
 }
+#endif
+
+/* Screen space level of detail for round objects */
+/* Objects with at least LOD_MIN_ROUND_SIDES sides are circles in disguise and */
+/* are drawn with the coarsest of the prebuilt meshes that still looks round */
+const int LOD_MIN_ROUND_SIDES = 32;
+const int LOD_LEVELS[] = { 8, 12, 16, 24, 32, 48, 64, 96, 128 };
+const int LOD_LEVEL_COUNT = sizeof(LOD_LEVELS) / sizeof(LOD_LEVELS[0]);
+
+// build all level of detail meshes up front so switching never creates one mid game
+void initLevelsOfDetail(){
+  for(int i = 0; i < LOD_LEVEL_COUNT; i++){
+    getPolygonMesh(LOD_LEVELS[i]);
+  }
+}
 
-void drawPolygon (GameObject polygon){
-  
-  // Compute ViewProject matrix as view/camera might not be changed for this frame (basic scenario)
-  //  Don't change unless you are sure!!
-  glm::mat4 VP = Matrices.projection * Matrices.view;
+// radius in pixels of a world space radius, through the ortho projection
+float projectedRadius(float radius){
+  float pixelsX = radius * Matrices.projection[0][0] * framebufferWidth * renderScale() / 2;
+  float pixelsY = radius * Matrices.projection[1][1] * framebufferHeight * renderScale() / 2;
+  return min(fabs(pixelsX), fabs(pixelsY));
+}
 
-  // Send our transformation to the currently bound shader, in the "MVP" uniform
-  // For each model you render, since the MVP will be different (at least the M part)
-  //  Don't change unless you are sure!!
-  glm::mat4 MVP;  // MVP = Projection * View * Model
+// number of sides to draw this object with in the current frame
+int levelOfDetail(GameObject &polygon){
+  int sides = polygon.getSides();
+  if(!Options.lod || sides < LOD_MIN_ROUND_SIDES){
+    return sides;
+  }
 
-  // Load identity to model matrix
-  Matrices.model = glm::mat4(1.0f);
+  // a rim with n sides strays r * (1 - cos(pi/n)) from the circle at most
+  float pixels = projectedRadius(polygon.getRadius());
+  if(pixels <= Options.lodTolerance){
+    return LOD_LEVELS[0];
+  }
+  float needed = M_PI / acos(max(-1.0f, 1 - Options.lodTolerance / pixels));
 
-  //cout << "position : " << polygon.getPosition().x << " " << polygon.getPosition().y << " " << polygon.getPosition().z << endl;
-  glm::mat4 translateMatrix = glm::translate (polygon.getPosition().getGlmVector());        // glTranslatef
-  glm::mat4 rotateMatrix = glm::rotate((float)((polygon.getRotationAngle() + polygon.getRotationValue()) * M_PI/180.0f), glm::vec3(0, 0, 1));  // rotate about vector (1,0,0)
-  
-  //Matrices.model *= translateMatrix;
-  Matrices.model *= translateMatrix * rotateMatrix;
-  MVP = VP * Matrices.model;
-  glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
+  for(int i = 0; i < LOD_LEVEL_COUNT && LOD_LEVELS[i] < sides; i++){
+    if(LOD_LEVELS[i] >= needed){
+      return LOD_LEVELS[i];
+    }
+  }
+  return sides;
+}
+
+/* Draw commands of the per-object path, sorted by render state before submission */
+/* Key, high to low bits : layer (8), program (16), fill mode (8), mesh VAO (32) */
+enum DrawLayer { LAYER_MODELS = 1, LAYER_LINES = 2 };
+
+struct DrawCommand {
+    unsigned long long key;
+    GLuint program;
+    VAO* mesh;
+    glm::vec4 transform;
+    float depth;
+    glm::vec3 color;
+    glm::vec4 tint;
+};
+
+vector<DrawCommand> drawList;
+
+unsigned long long drawSortKey (int layer, GLuint program, GLenum fillMode, GLuint mesh){
+  return ((unsigned long long)(layer & 0xFF) << 56)
+       | ((unsigned long long)(program & 0xFFFF) << 40)
+       | ((unsigned long long)(fillMode == GL_FILL ? 0 : 1) << 32)
+       | (unsigned long long)mesh;
+}
+
+bool compareDrawCommands (const DrawCommand &one, const DrawCommand &two){
+  return one.key < two.key;
+}
+
+// record a draw of mesh with programID; depth keeps overlaps right after sorting
+void recordDraw (int layer, VAO* mesh, glm::vec4 transform, float depth, glm::vec3 color, glm::vec4 tint){
+  DrawCommand command;
+  command.key = drawSortKey(layer, programID, mesh->FillMode, mesh->VertexArrayID);
+  command.program = programID;
+  command.mesh = mesh;
+  command.transform = transform;
+  command.depth = depth;
+  command.color = color;
+  command.tint = tint;
+  drawList.push_back(command);
+}
+
+// sort the frame's commands so equal state is adjacent and draw them through GLState
+void submitDrawList (){
+  stable_sort(drawList.begin(), drawList.end(), compareDrawCommands);
+
+  for(size_t i = 0; i < drawList.size(); i++){
+    DrawCommand &command = drawList[i];
+    if(renderingInSoftware()){
+      // the uniforms of Sample_GL.vert, read by rasterize3DObject()
+      Software.transform = command.transform;
+      Software.drawDepth = command.depth;
+      Software.objectColor = command.color;
+      Software.objectTint = command.tint;
+    }
+    else {
+      useProgram(command.program);
+      glUniform4fv(Matrices.TransformID, 1, &command.transform[0]);
+      glUniform1f(Matrices.DepthID, command.depth);
+      setMaterial(command.color, command.tint);
+    }
 
-  // draw3DObject draws the VAO given to it using current MVP matrix
-  draw3DObject(polygon.getDrawable());
+    // draw3DObject draws the VAO given to it using current transform
+    draw3DObject(command.mesh);
+  }
+  drawList.clear();
+}
+
+void drawPolygon (GameObject &polygon, float depth = 0){
+
+  // VP lives in the Frame uniform block, set once per frame by setCamera()
+  // The model matrix is composed in Sample_GL.vert from translation, rotation and radius
+  CoordinateVector position = polygon.getDrawPosition();
+  float angle = (polygon.getRotationAngle() + polygon.getDrawRotationValue()) * M_PI/180.0f;
+  glm::vec4 transform (position.x, position.y, angle, polygon.getRadius());
+
+  // drawn by submitDrawList() with the rest of the frame, depth keeps draw order
+  recordDraw(LAYER_MODELS, getPolygonMesh(levelOfDetail(polygon)), transform, position.z + depth, polygon.getDrawColor(), polygon.getTint());
 }
 
 void drawPolygonLine (VAO* line){
-  
-  // Compute ViewProject matrix as view/camera might not be changed for this frame (basic scenario)
-  //  Don't change unless you are sure!!
-  glm::mat4 VP = Matrices.projection * Matrices.view;
 
-  // Send our transformation to the currently bound shader, in the "MVP" uniform
-  // For each model you render, since the MVP will be different (at least the M part)
-  //  Don't change unless you are sure!!
-  glm::mat4 MVP;  // MVP = Projection * View * Model
+  // lines are already in world space and carry their own vertex colors
+  recordDraw(LAYER_LINES, line, glm::vec4(0, 0, 0, 1), 0, glm::vec3(1, 1, 1), glm::vec4(1, 1, 1, 0));
+}
+
+// draw every line queued this frame with one call
+void flushLines(){
+  int count = Lines.vertices.size() / 3;
+  if(count == 0){
+    return;
+  }
+  // start over in fresh storage when the ring is full, or grow it when the lines don't fit at all
+  bool orphan = Lines.Offset + count > Lines.Capacity;
+  if(count > Lines.Capacity){
+    Lines.Capacity = 2 * count;
+    orphan = true;
+  }
+  if(orphan){
+    Lines.Offset = 0;
+  }
 
-  // Load identity to model matrix
-  Matrices.model = glm::mat4(1.0f);
+  if(renderingInSoftware()){
+    Lines.drawable->vertices = Lines.vertices;
+    Lines.drawable->colors = Lines.colors;
+  }
+  else {
+    bindVertexArray (Lines.drawable->VertexArrayID);
+    streamToRing(0, Lines.drawable->VertexBuffer, Lines.vertices, orphan);
+    streamToRing(1, Lines.drawable->ColorBuffer, Lines.colors, orphan);
+  }
+  Lines.drawable->NumVertices = count;
+  Lines.Offset += count;
 
-  //cout << "position : " << polygon.getPosition().x << " " << polygon.getPosition().y << " " << polygon.getPosition().z << endl;
-  //glm::mat4 translateMatrix = glm::translate (polygon.getPosition().getGlmVector());        // glTranslatef
-  //glm::mat4 rotateMatrix = glm::rotate((float)((polygon.getRotationAngle() + polygon.getRotationValue()) * M_PI/180.0f), glm::vec3(0, 0, 1));  // rotate about vector (1,0,0)
-  
-  //Matrices.model *= translateMatrix;
-  //Matrices.model *= translateMatrix * rotateMatrix;
-  MVP = VP * Matrices.model;
-  glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
+  drawPolygonLine(Lines.drawable);
+
+  Lines.vertices.clear();
+  Lines.colors.clear();
+}
+
+/* Per-instance record read by Sample_GL_Instanced.vert as four RGBA32F texels */
+struct InstanceData {
+    GLfloat x, y, angle, radius;
+    GLfloat red, green, blue, depth;
+    GLfloat tintRed, tintGreen, tintBlue, tintAmount;
+    GLfloat sides, unused[3];
+};
+
+struct InstanceRenderer {
+    GLuint programID;
+    GLuint InstanceBaseID;
+    GLuint InstancesID;
+
+    GLuint InstanceBuffer;      // one buffer for every instance drawn this frame
+    GLuint InstanceTexture;     // buffer texture view of InstanceBuffer
+    GLsizeiptr BufferSize;
+    GLuint EmptyVAO;            // bound for procedural draws, which read no vertex attributes
+
+    map<int, vector<InstanceData> > groups;   // instances queued this frame per side count, per vertex budget when procedural
+    vector<InstanceData> uploads;
+} Instancing;
+
+void initInstancing(){
+  if(Options.procedural){
+    Instancing.programID = LoadShaders( "Sample_GL_Procedural.vert", "Sample_GL.frag" );
+  }
+  else {
+    Instancing.programID = LoadShaders( "Sample_GL_Instanced.vert", "Sample_GL.frag" );
+  }
+  bindFrameBlock(Instancing.programID);
+  Instancing.InstanceBaseID = glGetUniformLocation(Instancing.programID, "instanceBase");
+  Instancing.InstancesID = glGetUniformLocation(Instancing.programID, "instances");
+
+  glGenBuffers(1, &Instancing.InstanceBuffer);
+  glGenTextures(1, &Instancing.InstanceTexture);
+  Instancing.BufferSize = 0;
+
+  glGenVertexArrays(1, &Instancing.EmptyVAO);
+}
+
+// smallest power of two not below sides: procedural polygons are drawn in groups
+// of that many triangles, so any side count goes out in one of a few draws
+int proceduralBudget(int sides){
+  int budget = 4;
+  while(budget < sides){
+    budget *= 2;
+  }
+  return budget;
+}
+
+/* Round objects drawn as one quad each, the circle is cut out by Sample_GL_Circle.frag */
+struct CircleRenderer {
+    GLuint programID;
+    GLuint InstanceBaseID;
+    GLuint InstancesID;
+    GLuint OutlineWidthID;
+    GLuint OutlineColorID;
+
+    VAO* quad;
+    vector<InstanceData> circles;  // circles queued this frame, share the instance buffer
+} Circles;
+
+void initCircles(){
+  Circles.programID = LoadShaders( "Sample_GL_Circle.vert", "Sample_GL_Circle.frag" );
+  bindFrameBlock(Circles.programID);
+  Circles.InstanceBaseID = glGetUniformLocation(Circles.programID, "instanceBase");
+  Circles.InstancesID = glGetUniformLocation(Circles.programID, "instances");
+  Circles.OutlineWidthID = glGetUniformLocation(Circles.programID, "outlineWidth");
+  Circles.OutlineColorID = glGetUniformLocation(Circles.programID, "outlineColor");
+
+  static const GLfloat vertex_buffer_data [] = {
+    -1, -1, 0,
+     1, -1, 0,
+    -1,  1, 0,
+     1,  1, 0
+  };
+  Circles.quad = create3DObject(GL_TRIANGLE_STRIP, 4, vertex_buffer_data, 1, 1, 1, GL_FILL);
+}
+
+// draw the queued circles starting at base in the instance buffer, blended for smooth rims
+void drawCircles(int base){
+  useProgram(Circles.programID);
+  glUniform1i(Circles.InstancesID, 0);
+  glUniform1i(Circles.InstanceBaseID, base);
+  glUniform1f(Circles.OutlineWidthID, Options.circleOutline);
+  glUniform3f(Circles.OutlineColorID, 0, 0, 0);
+
+  glEnable(GL_BLEND);
+  glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+
+  setPolygonMode (Circles.quad->FillMode);
+  bindVertexArray (Circles.quad->VertexArrayID);
+  enableVertexAttributes (Circles.quad);
+  glDrawArraysInstanced(Circles.quad->PrimitiveMode, 0, Circles.quad->NumVertices, Circles.circles.size());
+
+  glDisable(GL_BLEND);
+
+  Stats.drawCalls++;
+  Stats.vertices += Circles.quad->NumVertices * Circles.circles.size();
+  Circles.circles.clear();
+}
 
-  // draw3DObject draws the VAO given to it using current MVP matrix
-  draw3DObject(line);
+// queue one object for this frame's instanced draw; depth keeps the painter's order
+void queueInstance(GameObject &polygon, float depth){
+  InstanceData instance;
+  CoordinateVector position = polygon.getDrawPosition();
+
+  instance.x = position.x;
+  instance.y = position.y;
+  instance.angle = (polygon.getRotationAngle() + polygon.getDrawRotationValue()) * M_PI/180.0f;
+  instance.radius = polygon.getRadius();
+
+  glm::vec3 color = polygon.getDrawColor();
+  instance.red = color[0];
+  instance.green = color[1];
+  instance.blue = color[2];
+  instance.depth = depth;
+
+  glm::vec4 tint = polygon.getTint();
+  instance.tintRed = tint[0];
+  instance.tintGreen = tint[1];
+  instance.tintBlue = tint[2];
+  instance.tintAmount = tint[3];
+
+  int sides = levelOfDetail(polygon);
+  instance.sides = sides;
+  instance.unused[0] = instance.unused[1] = instance.unused[2] = 0;
+
+  if(Options.sdfCircles && polygon.getSides() >= LOD_MIN_ROUND_SIDES){
+    Circles.circles.push_back(instance);
+  }
+  else if(Options.procedural){
+    Instancing.groups[proceduralBudget(sides)].push_back(instance);
+  }
+  else {
+    Instancing.groups[sides].push_back(instance);
+  }
+}
+
+// upload all queued instances at once and draw every side count with a single call
+void flushInstances(){
+
+  map<int, int> bases;
+  Instancing.uploads.clear();
+  for(map<int, vector<InstanceData> > :: iterator it = Instancing.groups.begin(); it != Instancing.groups.end(); it++){
+    bases[it->first] = Instancing.uploads.size();
+    Instancing.uploads.insert(Instancing.uploads.end(), it->second.begin(), it->second.end());
+  }
+  int circlesBase = Instancing.uploads.size();
+  Instancing.uploads.insert(Instancing.uploads.end(), Circles.circles.begin(), Circles.circles.end());
+  if(Instancing.uploads.empty()){
+    return;
+  }
+
+  // orphan last frame's storage so the driver never waits on it, grow when needed
+  GLsizeiptr size = Instancing.uploads.size() * sizeof(InstanceData);
+  if(size > Instancing.BufferSize){
+    Instancing.BufferSize = max(size, 2 * Instancing.BufferSize);
+  }
+  glBindBuffer(GL_TEXTURE_BUFFER, Instancing.InstanceBuffer);
+  glBufferData(GL_TEXTURE_BUFFER, Instancing.BufferSize, NULL, GL_STREAM_DRAW);
+  glBufferSubData(GL_TEXTURE_BUFFER, 0, size, &Instancing.uploads[0]);
+
+  useProgram(Instancing.programID);
+
+  glActiveTexture(GL_TEXTURE0);
+  glBindTexture(GL_TEXTURE_BUFFER, Instancing.InstanceTexture);
+  glTexBuffer(GL_TEXTURE_BUFFER, GL_RGBA32F, Instancing.InstanceBuffer);
+  glUniform1i(Instancing.InstancesID, 0);
+
+  for(map<int, vector<InstanceData> > :: iterator it = Instancing.groups.begin(); it != Instancing.groups.end(); it++){
+    if(it->second.empty()){
+      continue;
+    }
+    glUniform1i(Instancing.InstanceBaseID, bases[it->first]);
+
+    if(Options.procedural){
+      // vertices come from gl_VertexID, three per triangle of the group's budget
+      setPolygonMode (GL_FILL);
+      bindVertexArray (Instancing.EmptyVAO);
+      glDrawArraysInstanced(GL_TRIANGLES, 0, 3 * it->first, it->second.size());
+
+      Stats.drawCalls++;
+      Stats.vertices += 3 * it->first * it->second.size();
+
+      it->second.clear();
+      continue;
+    }
+
+    VAO* mesh = getPolygonMesh(it->first);
+
+    setPolygonMode (mesh->FillMode);
+    bindVertexArray (mesh->VertexArrayID);
+    enableVertexAttributes (mesh);
+
+    glDrawArraysInstanced(mesh->PrimitiveMode, 0, mesh->NumVertices, it->second.size());
+
+    Stats.drawCalls++;
+    Stats.vertices += mesh->NumVertices * it->second.size();
+
+    it->second.clear();  // keep the capacity for the next frame
+  }
+
+  if(!Circles.circles.empty()){
+    drawCircles(circlesBase);
+  }
+
+  // back to the regular program for lines
+  useProgram(programID);
 }
 
 
@@ -647,32 +2709,32 @@ void createGround(){
   int sides = 200;
   allGameObjects["ground1"] = GameObject(1.2, sides);
   allGameObjects["ground1"].setPosition(-3.2, -3.2, 0);
-  allGameObjects["ground1"].setVelocity(0, 0, 0);
-  allGameObjects["ground1"].setAcceleration(0, 0, 0);
+  allGameObjects["ground1"].setVelocity(0, 0);
+  allGameObjects["ground1"].setAcceleration(0, 0);
   allGameObjects["ground1"].setColors(0.3, 0.1, 0);
 
   allGameObjects["ground2"] = GameObject(1.2, sides);
   allGameObjects["ground2"].setPosition(-1.6, -3.2, 0);
-  allGameObjects["ground2"].setVelocity(0, 0, 0);
-  allGameObjects["ground2"].setAcceleration(0, 0, 0);
+  allGameObjects["ground2"].setVelocity(0, 0);
+  allGameObjects["ground2"].setAcceleration(0, 0);
   allGameObjects["ground2"].setColors(0.3, 0.1, 0);
 
   allGameObjects["ground3"] = GameObject(1.2, sides);
   allGameObjects["ground3"].setPosition(0, -3.2, 0);
-  allGameObjects["ground3"].setVelocity(0, 0, 0);
-  allGameObjects["ground3"].setAcceleration(0, 0, 0);
+  allGameObjects["ground3"].setVelocity(0, 0);
+  allGameObjects["ground3"].setAcceleration(0, 0);
   allGameObjects["ground3"].setColors(0.3, 0.1, 0);
 
   allGameObjects["ground4"] = GameObject(1.2, sides);
   allGameObjects["ground4"].setPosition(1.6, -3.2, 0);
-  allGameObjects["ground4"].setVelocity(0, 0, 0);
-  allGameObjects["ground4"].setAcceleration(0, 0, 0);
+  allGameObjects["ground4"].setVelocity(0, 0);
+  allGameObjects["ground4"].setAcceleration(0, 0);
   allGameObjects["ground4"].setColors(0.3, 0.1, 0);
 
   allGameObjects["ground5"] = GameObject(1.2, sides);
   allGameObjects["ground5"].setPosition(3.2, -3.2, 0);
-  allGameObjects["ground5"].setVelocity(0, 0, 0);
-  allGameObjects["ground5"].setAcceleration(0, 0, 0);
+  allGameObjects["ground5"].setVelocity(0, 0);
+  allGameObjects["ground5"].setAcceleration(0, 0);
   allGameObjects["ground5"].setColors(0.3, 0.1, 0);
 }
 
@@ -761,11 +2823,50 @@ void createCannon(){
   allGameObjects["cannon4"].setRotationAngle(45);
 }
 
+// scatter extra pigs and coins over the sky for stress levels
+void createStressObjects(int count){
+
+  srand(1);  // same layout on every run so runs can be compared
+  for(int i = 0; i < count; i++){
+    double x = -2.0 + 6.0 * rand() / RAND_MAX;
+    double y = -1.5 + 5.0 * rand() / RAND_MAX;
+    stringstream name;
+
+    if(i % 2){
+      name << "stresspig" << i;
+      allGameObjects[name.str()] = GameObject(0.17, 7);
+      allGameObjects[name.str()].setColors(40, 2, 0);
+      allGameObjects[name.str()].value = 50;
+    }
+    else {
+      name << "stresscoin" << i;
+      allGameObjects[name.str()] = GameObject(0.18, 200);
+      allGameObjects[name.str()].setColors(0.5, 0.2, 0.1);
+      allGameObjects[name.str()].value = 100;
+    }
+    allGameObjects[name.str()].setPosition(x, y, 0);
+  }
+}
+
+/* Mark every model whose name starts with prefix as scenery */
+void markStatic(string prefix){
+  for(map<string, GameObject> :: iterator it = allGameObjects.begin(); it != allGameObjects.end(); it++){
+    if(it->first.compare(0, prefix.size(), prefix) == 0){
+      it->second.setStatic(true);
+    }
+  }
+}
+
 void createAllObjects(){
 
   createGround();
   createCannon();
   createTree();
+
+  // scenery that stays put unless hit
+  markStatic("ground");
+  markStatic("cannon");
+  markStatic("tree");
   
   allGameObjects["player"] = GameObject(0.2, 5);
   
@@ -775,8 +2876,9 @@ void createAllObjects(){
     allGameObjects["cannon3"].getPosition().z
     );
 
-  allGameObjects["player"].setVelocity(0, 0, 0);
-  allGameObjects["player"].setAcceleration(0, 0, 0);
+  allGameObjects["player"].setVelocity(0, 0);
+  allGameObjects["player"].setProbe(true);  // its contacts drive the game, moving or not
+  allGameObjects["player"].setAcceleration(0, 0);
 
   // pigs
   allGameObjects["pig1"] = GameObject(0.17, 6);
@@ -809,15 +2911,399 @@ void createAllObjects(){
   allGameObjects["goal3"].setPosition(0.5, -1.0, 0);
   allGameObjects["goal3"].setColors(0.5, 0.2, 0.1);
   allGameObjects["goal3"].value = 100;
+
+  // a few still objects in clumps suit sweep and prune, crowds scattered everywhere suit the grid,
+  // and the tree keeps lookups logarithmic once there are tens of thousands
+  levelBroadphase = BROADPHASE_SWEEP;
+  if(Options.stressObjects){
+    createStressObjects(Options.stressObjects);
+    levelBroadphase = Options.stressObjects >= 10000 ? BROADPHASE_TREE : BROADPHASE_GRID;
+  }
 }
 
-void setCamera(){
-  // clear the color and depth in the frame buffer
+/* Immovable scenery baked into one world space triangle list, drawn with one call */
+/* Each baked object owns a range of vertices that is rewritten in place when it changes */
+struct BatchRange {
+    int first;  // first vertex
+    int count;  // vertices
+};
+
+struct StaticBatch {
+    VAO* drawable;
+    map<string, BatchRange> ranges;  // baked objects by name
+    vector<GLfloat> vertices;        // CPU copy of the vertex buffer
+    vector<GLfloat> colors;          // and of the color buffer
+    int objectCount;                 // number of models when baked, the draw order depends on it
+    int width, height;               // framebuffer size when baked, the level of detail depends on it
+} Batch;
+
+void initStaticBatch(){
+  Batch.drawable = create3DObject(GL_TRIANGLES, 0, NULL, NULL, GL_FILL);
+  Batch.objectCount = -1;
+  Batch.width = Batch.height = 0;
+}
+
+// write the world space triangles of polygon at vertex first, or collapse them if hidden
+void bakePolygon(GameObject &polygon, float depth, int first, int count, bool hidden){
+  CoordinateVector position = polygon.getDrawPosition();
+  float angle = (polygon.getRotationAngle() + polygon.getDrawRotationValue()) * M_PI/180.0f;
+  float c = cos(angle), s = sin(angle), radius = polygon.getRadius();
+  glm::vec3 color = polygon.getDrawColor();
+  glm::vec4 tint = polygon.getTint();
+  color = color * (1 - tint[3]) + glm::vec3(tint[0], tint[1], tint[2]) * tint[3];  // same as the shader mix()
+
+  int sides = count / 3;
+  double baseAngle = 2 * M_PI/sides;
+  for(int i = 0; i < count; i++){
+    GLfloat *v = &Batch.vertices[3 * (first + i)];
+    GLfloat *k = &Batch.colors[3 * (first + i)];
+
+    // triangle i / 3 of the fan : center, then two points of the rim
+    float x = 0, y = 0;
+    if(i % 3 != 0){
+      int rim = i / 3 + i % 3;
+      x = radius * cos(baseAngle * rim);
+      y = radius * sin(baseAngle * rim);
+    }
+    v[0] = hidden ? 0 : c * x - s * y + position.x;
+    v[1] = hidden ? 0 : s * x + c * y + position.y;
+    v[2] = position.z + depth;
+    k[0] = color[0];
+    k[1] = color[1];
+    k[2] = color[2];
+  }
+}
+
+// copy vertices [first, first + count) of the CPU copy into the buffers
+void uploadBatchRange(int first, int count){
+  bindArrayBuffer (Batch.drawable->VertexBuffer);
+  glBufferSubData (GL_ARRAY_BUFFER, 3 * first * sizeof(GLfloat), 3 * count * sizeof(GLfloat), &Batch.vertices[3 * first]);
+  bindArrayBuffer (Batch.drawable->ColorBuffer);
+  glBufferSubData (GL_ARRAY_BUFFER, 3 * first * sizeof(GLfloat), 3 * count * sizeof(GLfloat), &Batch.colors[3 * first]);
+}
+
+// bake every immovable object from scratch
+void bakeStaticBatch(){
+  Batch.ranges.clear();
+  Batch.vertices.clear();
+  Batch.colors.clear();
+
+  float order = 0, count = allGameObjects.size();
+  for(map<string, GameObject> :: iterator it = allGameObjects.begin(); it != allGameObjects.end(); it++){
+    float depth = order++ / count;
+    if(!it->second.isImmovable()){
+      it->second.setBatched(false);
+      continue;
+    }
+    BatchRange range;
+    range.first = Batch.vertices.size() / 3;
+    range.count = 3 * levelOfDetail(it->second);
+    Batch.vertices.resize(3 * (range.first + range.count));
+    Batch.colors.resize(3 * (range.first + range.count));
+    bakePolygon(it->second, depth, range.first, range.count, false);
+
+    Batch.ranges[it->first] = range;
+    it->second.setBatched(true);
+  }
+
+  int vertices = Batch.vertices.size() / 3;
+  bindArrayBuffer (Batch.drawable->VertexBuffer);
+  glBufferData (GL_ARRAY_BUFFER, Batch.vertices.size() * sizeof(GLfloat), vertices ? &Batch.vertices[0] : NULL, GL_STATIC_DRAW);
+  bindArrayBuffer (Batch.drawable->ColorBuffer);
+  glBufferData (GL_ARRAY_BUFFER, Batch.colors.size() * sizeof(GLfloat), vertices ? &Batch.colors[0] : NULL, GL_STATIC_DRAW);
+  Batch.drawable->NumVertices = vertices;
+
+  Batch.objectCount = allGameObjects.size();
+  Batch.width = framebufferWidth;
+  Batch.height = framebufferHeight;
+  Stats.batchBakes++;
+}
+
+// bring the batch up to date : rebake when the draw order or the level of detail moved,
+// otherwise rewrite just the objects that changed, collapsing those that started moving
+void updateStaticBatch(){
+  if(Batch.objectCount != (int)allGameObjects.size() || Batch.width != framebufferWidth || Batch.height != framebufferHeight){
+    bakeStaticBatch();
+    return;
+  }
+
+  float order = 0, count = allGameObjects.size();
+  for(map<string, GameObject> :: iterator it = allGameObjects.begin(); it != allGameObjects.end(); it++){
+    GameObject &polygon = it->second;
+    float depth = order++ / count;
+    if(!polygon.isBatchDirty()){
+      continue;
+    }
+    if(!polygon.isBatched()){
+      if(polygon.isImmovable()){
+        // newly static, needs a range of its own
+        bakeStaticBatch();
+        return;
+      }
+      continue;
+    }
+
+    BatchRange range = Batch.ranges[it->first];
+    bool moving = !polygon.isImmovable();
+    bakePolygon(polygon, depth, range.first, range.count, moving);
+    uploadBatchRange(range.first, range.count);
+    polygon.setBatched(!moving);
+    if(moving){
+      Batch.ranges.erase(it->first);
+    }
+    Stats.batchUpdates++;
+  }
+}
+
+// record the whole batch as one draw, vertices are already in world space
+void drawStaticBatch(){
+  updateStaticBatch();
+  if(Batch.drawable->NumVertices > 0){
+    recordDraw(LAYER_MODELS, Batch.drawable, glm::vec4(0, 0, 0, 1), 0, glm::vec3(1, 1, 1), glm::vec4(1, 1, 1, 0));
+  }
+}
+
+/* Which models a pass draws */
+enum ModelSet { MODELS_ALL, MODELS_STATIC, MODELS_DYNAMIC };
+
+// draw a subset of the models; depth follows the order of all models so passes combine
+void drawModels (int set){
+  if(Options.staticBatch && set != MODELS_DYNAMIC){
+    drawStaticBatch();
+  }
+
+  float order = 0, count = allGameObjects.size();
+  for(map<string, GameObject> :: iterator it = allGameObjects.begin(); it != allGameObjects.end(); it++){
+    float depth = order++ / count;
+    if(it->second.isBatched()){
+      continue;
+    }
+    if((set == MODELS_STATIC && !it->second.isStatic()) || (set == MODELS_DYNAMIC && it->second.isStatic())){
+      continue;
+    }
+
+    if(Options.instancing){
+      // queued and drawn grouped by mesh, later models sit in front
+      queueInstance(it->second, depth);
+    }
+    else {
+      // recorded one by one for submitDrawList(), later models sit in front
+      drawPolygon(it->second, depth);
+    }
+  }
+
+  if(Options.instancing){
+    flushInstances();
+  }
+}
+
+/* Scenery drawn once into an offscreen color and depth target */
+/* and copied to the screen with a full screen triangle every frame */
+struct StaticLayer {
+    GLuint Framebuffer;
+    GLuint ColorTexture;
+    GLuint DepthTexture;
+    int width, height;          // size of the textures, follows the framebuffer
+    int objectCount;            // number of models when drawn, the draw order depends on it
+
+    GLuint programID;
+    GLuint ColorID;
+    GLuint DepthID;
+} Scenery;
+
+void initStaticLayer(){
+  Scenery.programID = LoadShaders( "Sample_GL_Composite.vert", "Sample_GL_Composite.frag" );
+  Scenery.ColorID = glGetUniformLocation(Scenery.programID, "layerColor");
+  Scenery.DepthID = glGetUniformLocation(Scenery.programID, "layerDepth");
+
+  glGenFramebuffers(1, &Scenery.Framebuffer);
+  glGenTextures(1, &Scenery.ColorTexture);
+  glGenTextures(1, &Scenery.DepthTexture);
+  Scenery.width = Scenery.height = 0;
+  Scenery.objectCount = -1;
+}
+
+// (re)allocate the layer textures at the framebuffer size
+void resizeStaticLayer(){
+  Scenery.width = framebufferWidth;
+  Scenery.height = framebufferHeight;
+
+  glBindTexture(GL_TEXTURE_2D, Scenery.ColorTexture);
+  glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, Scenery.width, Scenery.height, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+
+  glBindTexture(GL_TEXTURE_2D, Scenery.DepthTexture);
+  glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT24, Scenery.width, Scenery.height, 0, GL_DEPTH_COMPONENT, GL_FLOAT, NULL);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+
+  glBindFramebuffer(GL_FRAMEBUFFER, Scenery.Framebuffer);
+  glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, Scenery.ColorTexture, 0);
+  glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, Scenery.DepthTexture, 0);
+  if(glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE){
+    cout << "static layer framebuffer incomplete" << endl;
+  }
+  glBindFramebuffer(GL_FRAMEBUFFER, sceneFramebuffer());
+}
+
+// redraw the static models into the layer if any of them changed
+void updateStaticLayer(){
+  bool resized = Scenery.width != framebufferWidth || Scenery.height != framebufferHeight;
+  if(resized){
+    resizeStaticLayer();
+  }
+  if(!resized && !staticSceneDirty && Scenery.objectCount == (int)allGameObjects.size()){
+    return;
+  }
+
+  glBindFramebuffer(GL_FRAMEBUFFER, Scenery.Framebuffer);
   glClear (GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+  drawModels(MODELS_STATIC);
+  submitDrawList();
+  glBindFramebuffer(GL_FRAMEBUFFER, sceneFramebuffer());
+
+  staticSceneDirty = false;
+  Scenery.objectCount = allGameObjects.size();
+  Stats.staticRenders++;
+}
+
+// copy the layer, color and depth, onto the screen
+void compositeStaticLayer(){
+  useProgram(Scenery.programID);
+
+  glActiveTexture(GL_TEXTURE1);
+  glBindTexture(GL_TEXTURE_2D, Scenery.ColorTexture);
+  glUniform1i(Scenery.ColorID, 1);
+  glActiveTexture(GL_TEXTURE2);
+  glBindTexture(GL_TEXTURE_2D, Scenery.DepthTexture);
+  glUniform1i(Scenery.DepthID, 2);
+  glActiveTexture(GL_TEXTURE0);
+
+  setPolygonMode (GL_FILL);
+  bindVertexArray (Instancing.EmptyVAO);
+  glDrawArrays(GL_TRIANGLES, 0, 3);
+
+  Stats.drawCalls++;
+  Stats.vertices += 3;
+}
+
+void initDynamicResolution(){
+  glGenFramebuffers(1, &Resolution.Framebuffer);
+  glGenRenderbuffers(1, &Resolution.ColorBuffer);
+  glGenRenderbuffers(1, &Resolution.DepthBuffer);
+  glGenQueries(RESOLUTION_QUERIES, Resolution.Queries);
+  for(int i = 0; i < RESOLUTION_QUERIES; i++){
+    Resolution.pending[i] = false;
+  }
+  Resolution.width = Resolution.height = 0;
+  Resolution.scale = Options.maxScale;
+  Resolution.next = 0;
+}
+
+// size the target for the largest scale, smaller scales use its lower left corner
+void resizeDynamicResolution(){
+  Resolution.width = ceil(Options.maxScale * framebufferWidth);
+  Resolution.height = ceil(Options.maxScale * framebufferHeight);
+
+  glBindRenderbuffer(GL_RENDERBUFFER, Resolution.ColorBuffer);
+  glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, Resolution.width, Resolution.height);
+  glBindRenderbuffer(GL_RENDERBUFFER, Resolution.DepthBuffer);
+  glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, Resolution.width, Resolution.height);
+
+  glBindFramebuffer(GL_FRAMEBUFFER, Resolution.Framebuffer);
+  glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, Resolution.ColorBuffer);
+  glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, Resolution.DepthBuffer);
+  if(glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE){
+    cout << "dynamic resolution framebuffer incomplete" << endl;
+  }
+}
+
+// move the scale toward the one that would have fit the budget; fill cost goes with the area
+void adjustResolution(float gpuMilliseconds){
+  Stats.gpuTime += gpuMilliseconds;
+  Stats.gpuFrames++;
+
+  float target = Resolution.scale * sqrt(Options.frameBudget / max(gpuMilliseconds, 0.01f));
+  target = min(max(target, Options.minScale), Options.maxScale);
+  float step = target - Resolution.scale;
+  if(step == 0 || (fabs(step) < 0.02 && target != Options.minScale && target != Options.maxScale)){
+    return;  // close enough, don't redraw cached layers for nothing
+  }
+  // ease towards the target, but land exactly on the limits so full scale stays sharp
+  Resolution.scale = fabs(step) < 0.02 ? target : Resolution.scale + 0.25 * step;
+  staticSceneDirty = true;
+}
+
+// take the results of finished timer queries
+void readResolutionQueries(){
+  for(int i = 0; i < RESOLUTION_QUERIES; i++){
+    int query = (Resolution.next + i) % RESOLUTION_QUERIES;
+    if(!Resolution.pending[query]){
+      continue;
+    }
+    GLuint available = 0, nanoseconds = 0;
+    glGetQueryObjectuiv(Resolution.Queries[query], GL_QUERY_RESULT_AVAILABLE, &available);
+    if(!available){
+      continue;
+    }
+    glGetQueryObjectuiv(Resolution.Queries[query], GL_QUERY_RESULT, &nanoseconds);
+    Resolution.pending[query] = false;
+    // a saturated 32 bit result (first frame compiling shaders, a stall) says nothing about load
+    if(nanoseconds != 0xFFFFFFFFu){
+      adjustResolution(nanoseconds / 1e6f);
+    }
+  }
+}
+
+// draw the scene into the scaled target from here on
+void beginScene(){
+  if(!Options.dynamicResolution){
+    return;
+  }
+  if(Resolution.width != (int)ceil(Options.maxScale * framebufferWidth) || Resolution.height != (int)ceil(Options.maxScale * framebufferHeight)){
+    resizeDynamicResolution();
+  }
+  readResolutionQueries();
+
+  glBindFramebuffer(GL_FRAMEBUFFER, Resolution.Framebuffer);
+  glViewport(0, 0, Resolution.scale * framebufferWidth, Resolution.scale * framebufferHeight);
+
+  // all queries still busy : this scene goes untimed
+  Resolution.timing = !Resolution.pending[Resolution.next];
+  if(Resolution.timing){
+    glBeginQuery(GL_TIME_ELAPSED, Resolution.Queries[Resolution.next]);
+  }
+}
+
+// scale the finished scene up to the screen
+void finishScene(){
+  if(!Options.dynamicResolution){
+    return;
+  }
+  if(Resolution.timing){
+    glEndQuery(GL_TIME_ELAPSED);
+    Resolution.pending[Resolution.next] = true;
+    Resolution.next = (Resolution.next + 1) % RESOLUTION_QUERIES;
+  }
+
+  glBindFramebuffer(GL_READ_FRAMEBUFFER, Resolution.Framebuffer);
+  glBindFramebuffer(GL_DRAW_FRAMEBUFFER, Output.Framebuffer);
+  glBlitFramebuffer(0, 0, Resolution.scale * framebufferWidth, Resolution.scale * framebufferHeight,
+                    0, 0, framebufferWidth, framebufferHeight, GL_COLOR_BUFFER_BIT, GL_LINEAR);
+  glBindFramebuffer(GL_FRAMEBUFFER, Output.Framebuffer);
+  glViewport(0, 0, framebufferWidth, framebufferHeight);
+}
+
+void setCamera(){
+  if(!renderingInSoftware()){
+    // clear the color and depth in the frame buffer
+    glClear (GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
-  // use the loaded shader program
-  // Don't change unless you know what you are doing
-  glUseProgram (programID);
+    // use the loaded shader program
+    // Don't change unless you know what you are doing
+    useProgram (programID);
+  }
 
   // Eye - Location of camera. Don't change unless you are sure!!
   glm::vec3 eye ( 5*cos(camera_rotation_angle*M_PI/180.0f), 0, 5*sin(camera_rotation_angle*M_PI/180.0f) );
@@ -830,14 +3316,287 @@ void setCamera(){
   // Matrices.view = glm::lookAt( eye, target, up ); // Rotating Camera for 3D
   //  Don't change unless you are sure!!
   Matrices.view = glm::lookAt(glm::vec3(0,0,3), target, up); // Fixed camera for 2D (ortho) in XY plane
+
+  // Upload the camera once for every program and object of this frame
+  FrameBlock frame;
+  frame.VP = Matrices.projection * Matrices.view;
+  frame.pixelSize = 1 / projectedRadius(1);
+  if(renderingInSoftware()){
+    beginSoftwareFrame(frame.VP);
+    return;
+  }
+  glBindBuffer(GL_UNIFORM_BUFFER, Matrices.FrameBuffer);
+  glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(FrameBlock), &frame);
+}
+
+double distance(double x, double y, double u, double v){
+  return sqrt(pow(u - x, 2) + pow(v - y, 2));
+}
+
+/* Frame pacing : the swap interval does vsync, the limiter sleeps to a deadline and spins the rest */
+const double PACING_SPIN = 0.002;  // seconds before the deadline to stop sleeping, sleeps wake up about this late
+
+const size_t PACING_HISTORY = 4096;  // frame times kept for the percentiles
+
+struct FramePacing {
+    double deadline;          // earliest time the limiter presents the next frame
+    double lastTime;          // when the previous frame was presented
+    vector<float> frameTimes; // milliseconds between presents, frame n at n % PACING_HISTORY
+    size_t frames;            // frame times recorded, whole run
+    double total, squares, worst; // sums and worst of every frame time, whole run
+    size_t reported;          // frame times already in a printStats() line
+} Pacing;
+
+const char* pacingName (){
+  const char* names[] = { "vsync", "adaptive vsync", "uncapped", "limit" };
+  return names[Options.pacing];
+}
+
+// pick the swap interval, a headless target has no display to sync to
+void initPacing (){
+  if(!Output.window){
+    if(Options.pacing == PACING_VSYNC || Options.pacing == PACING_ADAPTIVE){
+      Options.pacing = PACING_UNCAPPED;
+    }
+    return;
+  }
+#ifdef USE_GLFW
+  int interval = 0;
+  if(Options.pacing == PACING_VSYNC){
+    interval = 1;
+  }
+  else if(Options.pacing == PACING_ADAPTIVE){
+    // a late frame tears instead of waiting for the next refresh
+    if(glfwExtensionSupported("WGL_EXT_swap_control_tear") || glfwExtensionSupported("GLX_EXT_swap_control_tear")){
+      interval = -1;
+    }
+    else {
+      cout << "adaptive vsync not supported, using vsync" << endl;
+      Options.pacing = PACING_VSYNC;
+      interval = 1;
+    }
+  }
+  glfwSwapInterval(interval);
+#endif
+}
+
+// sleep most of the way, the scheduler wakes us late, and spin the rest
+void sleepUntil (double time){
+  double now = currentTime();
+  while(now < time){
+    if(time - now > PACING_SPIN){
+      this_thread::sleep_for(chrono::duration<double>(time - now - PACING_SPIN));
+    }
+    else {
+      this_thread::yield();
+    }
+    now = currentTime();
+  }
+}
+
+// hold the frame until its slot in the limiter's schedule
+void waitForDeadline (){
+  if(Options.pacing != PACING_LIMIT || Options.frameRate <= 0){
+    return;
+  }
+  double period = 1.0 / Options.frameRate;
+  double now = currentTime();
+  if(Output.frame == 0 || now > Pacing.deadline + period){
+    // a whole frame behind : start over rather than rush out frames to catch up
+    Pacing.deadline = now;
+  }
+  sleepUntil(Pacing.deadline);
+  Pacing.deadline += period;
+}
+
+void recordFrameTime (){
+  double now = currentTime();
+  if(Output.frame > 0){
+    float time = 1000 * (now - Pacing.lastTime);
+    if(Pacing.frameTimes.size() < PACING_HISTORY){
+      Pacing.frameTimes.push_back(time);
+    }
+    else {
+      Pacing.frameTimes[Pacing.frames % PACING_HISTORY] = time;
+    }
+    Pacing.frames++;
+    Pacing.total += time;
+    Pacing.squares += time * time;
+    Pacing.worst = max(Pacing.worst, (double)time);
+  }
+  Pacing.lastTime = now;
+}
+
+// nearest rank percentile of sorted times
+float percentile (vector<float> &times, double p){
+  size_t rank = max((size_t)ceil(p * times.size()), (size_t)1);
+  return times[min(rank, times.size()) - 1];
+}
+
+// mean, percentiles and jitter of the frame times from first on; percentiles only see
+// the last PACING_HISTORY of them, the whole run's mean, worst and jitter see all
+string frameTimeSummary (size_t first){
+  size_t count = Pacing.frames - min(first, Pacing.frames);
+  if(count == 0){
+    return "no frames timed";
+  }
+  vector<float> times;
+  for(size_t i = Pacing.frames - min(count, Pacing.frameTimes.size()); i < Pacing.frames; i++){
+    times.push_back(Pacing.frameTimes[i % PACING_HISTORY]);
+  }
+  double n = times.size(), total = 0, squares = 0, worst = 0;
+  for(float t : times){
+    total += t;
+    squares += t * t;
+    worst = max(worst, (double)t);
+  }
+  if(first == 0){
+    n = Pacing.frames;
+    total = Pacing.total;
+    squares = Pacing.squares;
+    worst = Pacing.worst;
+  }
+  double mean = total / n;
+  sort(times.begin(), times.end());
+  ostringstream out;
+  out << "frame ms mean " << mean
+      << " p50 " << percentile(times, 0.5)
+      << " p99 " << percentile(times, 0.99)
+      << " worst " << worst
+      << " jitter " << sqrt(max(squares / n - mean * mean, 0.0));
+  return out.str();
+}
+
+void finishPacing (){
+  double seconds = Pacing.total / 1000;
+  cout << "pacing : " << pacingName() << ", " << Pacing.frames << " frames";
+  if(seconds > 0){
+    cout << ", " << Pacing.frames / seconds << " fps";
+  }
+  cout << ", " << frameTimeSummary(0) << endl;
+}
+
+/* Cursor in window coordinates */
+void getCursorPos (double* x, double* y){
+#ifdef USE_GLFW
+    if (Output.window) {
+        glfwGetCursorPos(Output.window, x, y);
+        return;
+    }
+#endif
+    *x = Output.cursorX;
+    *y = Output.cursorY;
+}
+
+/* Aiming : the player sits on the cursor until it is fired. Late latch samples the cursor again */
+/* right before the frame is built, after sleeping off the time the finished frame would otherwise */
+/* wait for its present; prediction moves it ahead along its velocity by the measured latency */
+const double LATCH_MARGIN = 0.002;  // seconds left between the frame's estimated work and its present
+
+struct CursorLatch {
+    double x, y;          // latest sample, window coordinates
+    double vx, vy;        // smoothed velocity, pixels per second
+    double time;          // when the latest sample was taken
+    bool sampled;
+    double workEstimate;  // seconds from the latch to the swap, a decaying peak
+    double latency;       // smoothed seconds from the sample to the present, the prediction's lead
+    double totalLatency, worstLatency;  // whole run
+    int frames;
+} Cursor;
+
+// sample the cursor and put the aiming player on it
+void sampleCursor (){
+  double x, y;
+  getCursorPos(&x, &y);
+  double now = currentTime();
+  if(Cursor.sampled && now - Cursor.time > 0.001){
+    // smoothed so one jittery sample doesn't throw the prediction
+    Cursor.vx += 0.5 * ((x - Cursor.x) / (now - Cursor.time) - Cursor.vx);
+    Cursor.vy += 0.5 * ((y - Cursor.y) / (now - Cursor.time) - Cursor.vy);
+  }
+  Cursor.x = x;
+  Cursor.y = y;
+  Cursor.time = now;
+  Cursor.sampled = true;
+
+  if(Options.cursorPrediction){
+    x += Cursor.vx * Cursor.latency;
+    y += Cursor.vy * Cursor.latency;
+  }
+  if(!fired){
+    allGameObjects["player"].setPosition(x/75.0 - 4, 4.0 - 1.0 * y/75.0, 0.0);
+  }
+}
+
+// when the frame being built will be presented, 0 when it goes out as soon as it is done
+double nextPresentTime (){
+  if(Output.frame == 0){
+    return 0;
+  }
+  if(Options.pacing == PACING_LIMIT && Options.frameRate > 0){
+    return Pacing.deadline;
+  }
+#ifdef USE_GLFW
+  if(Output.window && (Options.pacing == PACING_VSYNC || Options.pacing == PACING_ADAPTIVE)){
+    // the last swap returned at a refresh
+    GLFWmonitor* monitor = glfwGetPrimaryMonitor();
+    const GLFWvidmode* mode = monitor ? glfwGetVideoMode(monitor) : NULL;
+    if(mode && mode->refreshRate > 0){
+      return Pacing.lastTime + 1.0 / mode->refreshRate;
+    }
+  }
+#endif
+  return 0;
+}
+
+// just in time for the present, take the freshest cursor
+void latchCursor (){
+  if(!Options.lateLatch){
+    return;
+  }
+  double present = nextPresentTime();
+  if(present > 0){
+    sleepUntil(present - Cursor.workEstimate - LATCH_MARGIN);
+  }
+  sampleCursor();
+}
+
+// the frame is built, learn how long that takes after the latch
+void finishCursorWork (){
+  if(Options.lateLatch){
+    double work = currentTime() - Cursor.time;
+    Cursor.workEstimate = max(work, Cursor.workEstimate + 0.05 * (work - Cursor.workEstimate));
+  }
+}
+
+// the frame is out, its cursor sample is this old
+void recordAimLatency (){
+  if(!Cursor.sampled){
+    return;
+  }
+  double latency = currentTime() - Cursor.time;
+  Cursor.latency += 0.1 * (latency - Cursor.latency);
+  Cursor.totalLatency += latency;
+  Cursor.worstLatency = max(Cursor.worstLatency, latency);
+  Cursor.frames++;
+  Stats.aimLatency += latency;
 }
 
-double distance(double x, double y, double u, double v){
-  return sqrt(pow(u - x, 2) + pow(v - y, 2));
+void finishAimLatency (){
+  if(Cursor.frames > 0){
+    cout << "aim latency : " << (Options.lateLatch ? "late latch" : "sampled at frame start")
+         << (Options.cursorPrediction ? " with prediction" : "")
+         << ", cursor to present ms mean " << 1000 * Cursor.totalLatency / Cursor.frames
+         << " worst " << 1000 * Cursor.worstLatency << endl;
+  }
 }
 
 void drawAllObjects (){
-  
+
+  latchCursor();
+
+  double start = currentTime();
+  beginScene();
   setCamera();
   
   double s = .0;
@@ -845,7 +3604,7 @@ void drawAllObjects (){
   if(!fired){
     GLfloat vbd[]={
       allGameObjects["cannon4"].getPosition().x, allGameObjects["cannon4"].getPosition().y + 0.1, 0,
-      allGameObjects["player"].getPosition().x, allGameObjects["player"].getPosition().y, 0
+      allGameObjects["player"].getDrawPosition().x, allGameObjects["player"].getDrawPosition().y, 0
     };
     
     GLfloat color_buffer_data[]={
@@ -853,8 +3612,9 @@ void drawAllObjects (){
       2.6, 3.5, 0
     };
 
+    // behind every model
     LineObject line1(vbd, color_buffer_data);
-    drawPolygonLine(line1.getDrawable());
+    line1.queue(-0.5);
     s = distance(vbd[0], vbd[1], vbd[3], vbd[4]);
   }
 
@@ -874,17 +3634,22 @@ void drawAllObjects (){
     };
 
     LineObject powerline(vertex_buffer_data0, color_buffer_data);
-    drawPolygonLine(powerline.getDrawable());
+    powerline.queue(-0.5);
 
-  // draw all models one by one
-  for(map<string, GameObject> :: iterator it = allGameObjects.begin(); it != allGameObjects.end(); it++){
-    drawPolygon(it->second);
+  if(Options.staticLayer){
+    // scenery from the cached layer, then everything that moves
+    updateStaticLayer();
+    compositeStaticLayer();
+    drawModels(MODELS_DYNAMIC);
+  }
+  else {
+    drawModels(MODELS_ALL);
   }
 
   if(!fired){
     GLfloat vertex_buffer_data2[] = {
       allGameObjects["cannon4"].getPosition().x, allGameObjects["cannon4"].getPosition().y, 0,
-      allGameObjects["player"].getPosition().x, allGameObjects["player"].getPosition().y, 0
+      allGameObjects["player"].getDrawPosition().x, allGameObjects["player"].getDrawPosition().y, 0
     };
     
     GLfloat color_buffer_data[] = {
@@ -892,17 +3657,27 @@ void drawAllObjects (){
       2.6, 3.5, 0
     };
 
+    // in front of every model
     LineObject line2(vertex_buffer_data2, color_buffer_data);
-    drawPolygonLine (line2.getDrawable());
+    line2.queue(1.0);
   }
 
+  // all lines of the frame in one draw, depth keeps them in order with the models
+  flushLines();
+
+  // per-object draws, sorted by state
+  submitDrawList();
+
+  // up to the screen when drawn at a lower resolution
+  finishScene();
+
+  Stats.drawTime += currentTime() - start;
+
 }
 
 // update all objects by usual values
 void updateAllObjects(){
-  for(map<string, GameObject> :: iterator it = allGameObjects.begin() ; it != allGameObjects.end(); it++){
-    it->second.updateState();
-  }
+  integrateBodies(SIM_TICK_RATE / Options.stepRate);
 }
 
 void CollisionResponse(GameObject &one, GameObject &two) {
@@ -938,7 +3713,7 @@ void CollisionResponse(GameObject &one, GameObject &two) {
   vbf.y = vbi.y - Jy/mb;
 
   //cout<<"one : "<<vaf.x<<" "<<vaf.y<<endl;
-  one.setVelocity(vaf.x, vaf.y , 0);
+  one.setVelocity(vaf.x, vaf.y);
 }
 
 int c = 0;
@@ -947,9 +3722,28 @@ int c = 0;
 void handleCollisions(){
   
   if(fired){
-    for(map<string, GameObject> :: iterator it = allGameObjects.begin(); it != allGameObjects.end(); it++){
+    // objects whose bounds touch the player's, in name order like a walk over allGameObjects
+    vector<BodyPair> pairs;
+    findPairs(pairs);
+    indexBodies();
+    int player = allGameObjects["player"].getBody();
+    vector<string> touching;
+    for(BodyPair pair : pairs){
+      int other = pair.one == player ? pair.two : pair.one;
+      if((pair.one == player || pair.two == player) && Owners.names[other]){
+        touching.push_back(*Owners.names[other]);
+      }
+    }
+    sort(touching.begin(), touching.end());
+
+    for(string name : touching){
+      map<string, GameObject> :: iterator it = allGameObjects.find(name);
+      if(it == allGameObjects.end()){
+        continue;
+      }
       
       bool collided = CheckCollision(allGameObjects["player"], it->second);
+      bool destroyed = false;
       
       if(collided && 
         it->first != "player" && it->first != "cannon0" && it->first != "cannon1" && it->first != "cannon2" && it->first != "cannon3" && it->first != "cannon4" && it->first != "cannon5" && it->first != "cannon6"){
@@ -962,8 +3756,8 @@ void handleCollisions(){
           c++;
           if(allGameObjects["player"].getPosition().y <= -2.0){
             allGameObjects["player"].setPosition(allGameObjects["player"].getPosition().x, -2.0, 0);
-            allGameObjects["player"].setAcceleration(0, 0, 0);
-            allGameObjects["player"].setVelocity(0, 0, 0);
+            allGameObjects["player"].setAcceleration(0, 0);
+            allGameObjects["player"].setVelocity(0, 0);
             allGameObjects["player"].setRotationValue(0);
           }
         }
@@ -977,22 +3771,68 @@ void handleCollisions(){
           if(it->first == "goal1" || it->first == "goal2" || it->first == "goal3" || it->second.score > 25) {
             allGameObjects["player"].score += it->second.value;
             cout<<"score : "<<allGameObjects["player"].score<<endl;
-            allGameObjects.erase(it);
+            destroyed = true;
           }
 
+          // material only, no GPU work however often it is hit
           it->second.setColors(it->second.red, it->second.green, 0.2);
+          it->second.setTint(1, 1, 1, 0.6);
           //CollisionResponse(allGameObjects["player"], it->second);
           allGameObjects["player"].setVelocity(allGameObjects["player"].getVelocity() * -0.8);
           allGameObjects["player"].setRotationValue(allGameObjects["player"].getRotationValue() + 5);
 
         }
       }
+
+      if(destroyed){
+        allGameObjects.erase(it);
+      }
     }
   }
 
 }
 
+// one fixed step of the game
+void stepSimulation(){
+  saveBodies();
+  handleCollisions();
+  updateAllObjects();
+  allGameObjects["player"].rotate(5 * SIM_TICK_RATE / Options.stepRate);
+}
+
+// run the steps owed for the time since the last frame, at most Options.maxSteps of them
+void advanceSimulation(){
+  double start = currentTime();
+  double step = 1.0 / Options.stepRate;
+  if(Output.backend != BACKEND_WINDOW || !Simulation.started){
+    // headless runs stay reproducible : every frame is one tick of the tuned rate
+    Simulation.accumulator += 1.0 / SIM_TICK_RATE;
+  }
+  else {
+    Simulation.accumulator += start - Simulation.lastTime;
+  }
+  Simulation.lastTime = start;
+  Simulation.started = true;
+
+  int steps = 0;
+  while(Simulation.accumulator >= step && steps < Options.maxSteps){
+    stepSimulation();
+    Simulation.accumulator -= step;
+    steps++;
+  }
+  if(Simulation.accumulator >= step){
+    // too far behind, let the game slow down rather than spend ever longer catching up
+    Stats.droppedSteps += (int)(Simulation.accumulator / step);
+    Simulation.accumulator = fmod(Simulation.accumulator, step);
+  }
+  Simulation.alpha = Simulation.accumulator / step;
+
+  Stats.simSteps += steps;
+  Stats.simTime += currentTime() - start;
+}
+
 
+#ifdef USE_GLFW
 /* Initialise glfw window, I/O callbacks and the renderer to use */
 /* Nothing to Edit here */
 GLFWwindow* initGLFW (int width, int height){
@@ -1017,7 +3857,6 @@ GLFWwindow* initGLFW (int width, int height){
 
     glfwMakeContextCurrent(window);
     gladLoadGLLoader((GLADloadproc) glfwGetProcAddress);
-    glfwSwapInterval( 1 );
 
     /* --- register callbacks with GLFW --- */
 
@@ -1039,17 +3878,754 @@ GLFWwindow* initGLFW (int width, int height){
 
     return window;
 }
+#endif
+
+#ifdef USE_EGL
+/* OpenGL 3.3 core context on a surfaceless EGL display, e.g. Mesa llvmpipe without any GPU */
+void initEGL (){
+    PFNEGLGETPLATFORMDISPLAYEXTPROC getPlatformDisplay = (PFNEGLGETPLATFORMDISPLAYEXTPROC) eglGetProcAddress("eglGetPlatformDisplayEXT");
+    Output.eglDisplay = getPlatformDisplay ? getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL) : eglGetDisplay(EGL_DEFAULT_DISPLAY);
+
+    EGLint major, minor;
+    if (Output.eglDisplay == EGL_NO_DISPLAY || !eglInitialize(Output.eglDisplay, &major, &minor)) {
+        fprintf(stderr, "Error: no EGL display\n");
+        exit(EXIT_FAILURE);
+    }
+
+    EGLint configAttributes[] = { EGL_SURFACE_TYPE, EGL_PBUFFER_BIT, EGL_RED_SIZE, 8, EGL_GREEN_SIZE, 8, EGL_BLUE_SIZE, 8, EGL_DEPTH_SIZE, 24,
+                                  EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT, EGL_NONE };
+    EGLConfig config;
+    EGLint count;
+    if (!eglChooseConfig(Output.eglDisplay, configAttributes, &config, 1, &count) || count < 1) {
+        fprintf(stderr, "Error: no EGL config for OpenGL\n");
+        exit(EXIT_FAILURE);
+    }
+
+    eglBindAPI(EGL_OPENGL_API);
+    EGLint contextAttributes[] = { EGL_CONTEXT_MAJOR_VERSION, 3, EGL_CONTEXT_MINOR_VERSION, 3,
+                                   EGL_CONTEXT_OPENGL_PROFILE_MASK, EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT, EGL_NONE };
+    Output.eglContext = eglCreateContext(Output.eglDisplay, config, EGL_NO_CONTEXT, contextAttributes);
+
+    // no surface at all, frames go to the framebuffer made in openOutput()
+    if (Output.eglContext == EGL_NO_CONTEXT || !eglMakeCurrent(Output.eglDisplay, EGL_NO_SURFACE, EGL_NO_SURFACE, Output.eglContext)) {
+        fprintf(stderr, "Error: EGL context 0x%x\n", eglGetError());
+        exit(EXIT_FAILURE);
+    }
+    gladLoadGLLoader((GLADloadproc) eglGetProcAddress);
+}
+#endif
+
+#ifdef USE_OSMESA
+/* OpenGL 3.3 core context rendering into memory with OSMesa */
+void initOSMesa (int width, int height){
+    const int attributes[] = { OSMESA_FORMAT, OSMESA_RGBA, OSMESA_DEPTH_BITS, 24,
+                               OSMESA_PROFILE, OSMESA_CORE_PROFILE,
+                               OSMESA_CONTEXT_MAJOR_VERSION, 3, OSMESA_CONTEXT_MINOR_VERSION, 3, 0 };
+    Output.osmesaContext = OSMesaCreateContextAttribs(attributes, NULL);
+    Output.osmesaPixels.resize(4 * width * height);
+
+    if (!Output.osmesaContext || !OSMesaMakeCurrent(Output.osmesaContext, &Output.osmesaPixels[0], GL_UNSIGNED_BYTE, width, height)) {
+        fprintf(stderr, "Error: no OSMesa context\n");
+        exit(EXIT_FAILURE);
+    }
+    gladLoadGLLoader((GLADloadproc) OSMesaGetProcAddress);
+}
+#endif
+
+/* Frame capture : glReadPixels into a ring of pixel buffer objects, each fenced and only mapped */
+/* CAPTURE_DELAY frames later when the GPU is long done with it, so the render thread never waits. */
+/* A worker thread writes the images straight from the mapped buffers. */
+const int CAPTURE_RING = 4;     // pixel buffers
+const int CAPTURE_DELAY = 2;    // frames from reading into a buffer to mapping it
+
+struct CapturedFrame {
+    int number;
+    int width, height;
+    int channels;               // 4 from the pixel buffers, 3 from the software rasterizer
+    const GLubyte* pixels;      // bottom row first
+    vector<GLubyte> copy;       // owns the pixels when they are not a mapped buffer
+    int slot;                   // ring slot mapped for this frame, -1 for none
+};
+
+struct FrameCapture {
+    GLuint Buffers[CAPTURE_RING];   // GL_PIXEL_PACK_BUFFER per slot
+    GLsync Fences[CAPTURE_RING];    // signalled when the slot's read is done, 0 once mapped
+    int frameOf[CAPTURE_RING];      // frame number in each slot
+    int widthOf[CAPTURE_RING], heightOf[CAPTURE_RING];
+    int sizeOf[CAPTURE_RING];       // bytes allocated for each slot
+    bool mapped[CAPTURE_RING];      // mapped and handed to the worker
+    bool busy[CAPTURE_RING];        // the worker is not done with the mapped slot yet
+    int next;                       // frames captured so far
+
+    thread worker;
+    mutex lock;
+    condition_variable ready;       // frames were queued
+    condition_variable done;        // a mapped slot was written
+    deque<CapturedFrame> queue;     // read back, waiting to be written
+    bool stopping;
+    int written;
+} Capture;
+
+unsigned long crcTable[256];
+
+// checksum of PNG chunks
+unsigned long crc32 (unsigned long crc, const GLubyte* data, size_t length){
+  if(crcTable[1] == 0){
+    for(unsigned long n = 0; n < 256; n++){
+      unsigned long c = n;
+      for(int k = 0; k < 8; k++){
+        c = (c & 1) ? 0xEDB88320UL ^ (c >> 1) : c >> 1;
+      }
+      crcTable[n] = c;
+    }
+  }
+  crc = crc ^ 0xFFFFFFFFUL;
+  for(size_t i = 0; i < length; i++){
+    crc = crcTable[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+  }
+  return crc ^ 0xFFFFFFFFUL;
+}
+
+void putBigEndian (vector<GLubyte> &out, unsigned long value){
+  for(int shift = 24; shift >= 0; shift -= 8){
+    out.push_back((value >> shift) & 0xFF);
+  }
+}
+
+void writePNGChunk (FILE* file, const char* type, vector<GLubyte> &data){
+  vector<GLubyte> chunk(type, type + 4);
+  chunk.insert(chunk.end(), data.begin(), data.end());
+  vector<GLubyte> header, footer;
+  putBigEndian(header, data.size());
+  putBigEndian(footer, crc32(0, &chunk[0], chunk.size()));
+  fwrite(&header[0], 1, 4, file);
+  fwrite(&chunk[0], 1, chunk.size(), file);
+  fwrite(&footer[0], 1, 4, file);
+}
+
+// rgb rows, top first, as a PNG with stored (uncompressed) deflate blocks : no zlib needed
+void writePNG (FILE* file, int width, int height, vector<GLubyte> &rgb){
+  const GLubyte signature[8] = { 137, 'P', 'N', 'G', '\r', '\n', 26, '\n' };
+  fwrite(signature, 1, 8, file);
+
+  vector<GLubyte> header;
+  putBigEndian(header, width);
+  putBigEndian(header, height);
+  GLubyte format[5] = { 8, 2, 0, 0, 0 };  // 8 bit rgb, no interlace
+  header.insert(header.end(), format, format + 5);
+  writePNGChunk(file, "IHDR", header);
+
+  // every row starts with filter type 0
+  vector<GLubyte> raw;
+  raw.reserve((3 * width + 1) * height);
+  for(int y = 0; y < height; y++){
+    raw.push_back(0);
+    raw.insert(raw.end(), rgb.begin() + 3 * width * y, rgb.begin() + 3 * width * (y + 1));
+  }
+
+  vector<GLubyte> data;
+  data.push_back(0x78);
+  data.push_back(0x01);
+  unsigned long a = 1, b = 0;
+  for(size_t start = 0; start < raw.size(); start += 65535){
+    size_t length = min((size_t)65535, raw.size() - start);
+    data.push_back(start + length == raw.size() ? 1 : 0);
+    data.push_back(length & 0xFF);
+    data.push_back(length >> 8);
+    data.push_back(~length & 0xFF);
+    data.push_back((~length >> 8) & 0xFF);
+    data.insert(data.end(), raw.begin() + start, raw.begin() + start + length);
+    for(size_t i = start; i < start + length; i++){
+      a = (a + raw[i]) % 65521;
+      b = (b + a) % 65521;
+    }
+  }
+  putBigEndian(data, (b << 16) | a);
+  writePNGChunk(file, "IDAT", data);
+
+  vector<GLubyte> end;
+  writePNGChunk(file, "IEND", end);
+}
+
+// flip to top row first, drop alpha and write one frame as PPM or PNG into directory
+void writeCapturedFrame (CapturedFrame &frame, const string &directory, bool png){
+  vector<GLubyte> rgb(3 * frame.width * frame.height);
+  for(int y = 0; y < frame.height; y++){
+    const GLubyte* row = &frame.pixels[frame.channels * frame.width * (frame.height - 1 - y)];
+    for(int x = 0; x < frame.width; x++){
+      memcpy(&rgb[3 * (frame.width * y + x)], &row[frame.channels * x], 3);
+    }
+  }
+
+  char name[32];
+  snprintf(name, sizeof(name), "/frame%05d.%s", frame.number, png ? "png" : "ppm");
+  string path = directory + name;
+  FILE* file = fopen(path.c_str(), "wb");
+  if(!file){
+    cout << "capture : cannot write " << path << endl;
+    return;
+  }
+  if(png){
+    writePNG(file, frame.width, frame.height, rgb);
+  }
+  else {
+    fprintf(file, "P6\n%d %d\n255\n", frame.width, frame.height);
+    fwrite(&rgb[0], 1, rgb.size(), file);
+  }
+  fclose(file);
+}
+
+// worker : write frames as they arrive until told to stop and the queue is empty
+void captureWorker (){
+  while(true){
+    unique_lock<mutex> guard(Capture.lock);
+    Capture.ready.wait(guard, []{ return Capture.stopping || !Capture.queue.empty(); });
+    if(Capture.queue.empty()){
+      return;
+    }
+    CapturedFrame frame;
+    swap(frame, Capture.queue.front());
+    Capture.queue.pop_front();
+    guard.unlock();
+
+    writeCapturedFrame(frame, Options.capture, Options.capturePNG);
+
+    guard.lock();
+    Capture.written++;
+    if(frame.slot >= 0){
+      Capture.busy[frame.slot] = false;
+      Capture.done.notify_all();
+    }
+  }
+}
+
+void queueCapturedFrame (CapturedFrame &frame){
+  {
+    lock_guard<mutex> guard(Capture.lock);
+    if(frame.slot >= 0){
+      Capture.busy[frame.slot] = true;
+    }
+    Capture.queue.push_back(CapturedFrame());
+    swap(Capture.queue.back(), frame);
+  }
+  Capture.ready.notify_one();
+}
+
+void initCapture (){
+  Capture.next = 0;
+  Capture.stopping = false;
+  Capture.written = 0;
+  if(!renderingInSoftware()){
+    glGenBuffers(CAPTURE_RING, Capture.Buffers);
+  }
+  for(int i = 0; i < CAPTURE_RING; i++){
+    Capture.Fences[i] = 0;
+    Capture.sizeOf[i] = 0;
+    Capture.mapped[i] = Capture.busy[i] = false;
+  }
+  Capture.worker = thread(captureWorker);
+}
+
+// map a slot whose read has finished and hand it to the worker
+void mapCaptureSlot (int slot){
+  if(!Capture.Fences[slot]){
+    return;
+  }
+  // signalled long ago unless the GPU is CAPTURE_DELAY frames behind
+  glClientWaitSync(Capture.Fences[slot], GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000);
+  glDeleteSync(Capture.Fences[slot]);
+  Capture.Fences[slot] = 0;
+
+  CapturedFrame frame;
+  frame.number = Capture.frameOf[slot];
+  frame.width = Capture.widthOf[slot];
+  frame.height = Capture.heightOf[slot];
+  frame.channels = 4;
+  frame.slot = slot;
+
+  glBindBuffer(GL_PIXEL_PACK_BUFFER, Capture.Buffers[slot]);
+  frame.pixels = (const GLubyte*) glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, 4 * frame.width * frame.height, GL_MAP_READ_BIT);
+  glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+  if(!frame.pixels){
+    return;
+  }
+  Capture.mapped[slot] = true;
+  queueCapturedFrame(frame);
+}
+
+// unmap a slot once the worker has written it, so it can be read into again
+void releaseCaptureSlot (int slot){
+  if(!Capture.mapped[slot]){
+    return;
+  }
+  {
+    unique_lock<mutex> guard(Capture.lock);
+    Capture.done.wait(guard, [slot]{ return !Capture.busy[slot]; });
+  }
+  glBindBuffer(GL_PIXEL_PACK_BUFFER, Capture.Buffers[slot]);
+  glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+  glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+  Capture.mapped[slot] = false;
+}
+
+// capture the frame just drawn, called before it is presented
+void captureFrame (){
+  double start = currentTime();
+  int number = Capture.next++;
+  int width = framebufferWidth, height = framebufferHeight;
+
+  if(renderingInSoftware()){
+    // already in memory, the worker gets a copy
+    CapturedFrame frame;
+    frame.number = number;
+    frame.width = width;
+    frame.height = height;
+    frame.channels = 3;
+    frame.copy = Software.color;
+    frame.pixels = &frame.copy[0];
+    frame.slot = -1;
+    queueCapturedFrame(frame);
+    Stats.captureTime += currentTime() - start;
+    return;
+  }
+
+  // start reading this frame into its slot, written CAPTURE_RING frames ago
+  int slot = number % CAPTURE_RING;
+  releaseCaptureSlot(slot);
+
+  int size = 4 * width * height;
+  glBindBuffer(GL_PIXEL_PACK_BUFFER, Capture.Buffers[slot]);
+  if(Capture.sizeOf[slot] != size){
+    glBufferData(GL_PIXEL_PACK_BUFFER, size, NULL, GL_STREAM_READ);
+    Capture.sizeOf[slot] = size;
+  }
+  glBindFramebuffer(GL_READ_FRAMEBUFFER, Output.Framebuffer);
+  glReadPixels(0, 0, width, height, GL_RGBA, GL_UNSIGNED_BYTE, 0);  // into the buffer, returns at once
+  glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+  Capture.Fences[slot] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+  Capture.frameOf[slot] = number;
+  Capture.widthOf[slot] = width;
+  Capture.heightOf[slot] = height;
+
+  // the frame read CAPTURE_DELAY frames ago is ready by now
+  mapCaptureSlot((number + CAPTURE_RING - CAPTURE_DELAY) % CAPTURE_RING);
+
+  Stats.captureTime += currentTime() - start;
+}
+
+// read back the frames still in flight, wait for the worker to write everything and unmap
+void finishCapture (){
+  if(!renderingInSoftware()){
+    for(int i = CAPTURE_DELAY; i > 0; i--){
+      mapCaptureSlot((Capture.next + CAPTURE_RING - i) % CAPTURE_RING);
+    }
+  }
+  {
+    lock_guard<mutex> guard(Capture.lock);
+    Capture.stopping = true;
+  }
+  Capture.ready.notify_one();
+  Capture.worker.join();
+  if(!renderingInSoftware()){
+    for(int i = 0; i < CAPTURE_RING; i++){
+      releaseCaptureSlot(i);
+    }
+  }
+  cout << "capture : " << Capture.written << " frames written to " << Options.capture << endl;
+}
+
+/* Golden image run : every GOLDEN_INTERVAL frames the image is compared with a stored reference, */
+/* with some tolerance for edge pixels and rounding, and frame times are recorded alongside */
+const int GOLDEN_INTERVAL = 30;
+const float GOLDEN_COLOR_TOLERANCE = 24;  // largest color distance, see colorDistance(), that still matches
+
+struct GoldenRun {
+    int compared;       // frames compared or written
+    int failed;         // frames over Options.goldenTolerance
+    double lastTime;    // when the previous frame was presented
+    double totalTime;   // frame times, for the mean
+    double worstTime;
+    int timedFrames;
+} Golden;
+
+// the pixels of the frame just drawn, bottom row first
+void readFrame (vector<GLubyte> &rgb){
+  rgb.resize(3 * framebufferWidth * framebufferHeight);
+  if(renderingInSoftware()){
+    rgb = Software.color;
+    return;
+  }
+  glBindFramebuffer(GL_READ_FRAMEBUFFER, Output.Framebuffer);
+  glPixelStorei(GL_PACK_ALIGNMENT, 1);
+  glReadPixels(0, 0, framebufferWidth, framebufferHeight, GL_RGB, GL_UNSIGNED_BYTE, &rgb[0]);
+}
+
+// binary PPM as written by writeCapturedFrame(), rows turned to bottom first
+bool readPPM (const string &path, int &width, int &height, vector<GLubyte> &rgb){
+  FILE* file = fopen(path.c_str(), "rb");
+  if(!file){
+    return false;
+  }
+  int maximum;
+  bool ok = fscanf(file, "P6 %d %d %d", &width, &height, &maximum) == 3 && fgetc(file) != EOF && maximum == 255;
+  vector<GLubyte> rows(3 * width * height);
+  ok = ok && fread(&rows[0], 1, rows.size(), file) == rows.size();
+  fclose(file);
+
+  rgb.resize(rows.size());
+  for(int y = 0; ok && y < height; y++){
+    memcpy(&rgb[3 * width * y], &rows[3 * width * (height - 1 - y)], 3 * width);
+  }
+  return ok;
+}
+
+// perceptual color distance ("redmean"), 0 to about 765, weights green most and blue by how red it is
+float colorDistance (const GLubyte* a, const GLubyte* b){
+  float mean = (a[0] + b[0]) / 2.0f;
+  float r = a[0] - b[0], g = a[1] - b[1], bl = a[2] - b[2];
+  return sqrt((2 + mean / 256) * r * r + 4 * g * g + (2 + (255 - mean) / 256) * bl * bl);
+}
+
+// percent of pixels with no close match in the reference at the same place or one pixel away
+float goldenDifference (vector<GLubyte> &frame, vector<GLubyte> &reference, int width, int height){
+  int differing = 0;
+  for(int y = 0; y < height; y++){
+    for(int x = 0; x < width; x++){
+      const GLubyte* pixel = &frame[3 * (width * y + x)];
+      bool matched = false;
+      for(int dy = -1; dy <= 1 && !matched; dy++){
+        for(int dx = -1; dx <= 1 && !matched; dx++){
+          int nx = x + dx, ny = y + dy;
+          if(nx >= 0 && nx < width && ny >= 0 && ny < height){
+            matched = colorDistance(pixel, &reference[3 * (width * ny + nx)]) <= GOLDEN_COLOR_TOLERANCE;
+          }
+        }
+      }
+      differing += matched ? 0 : 1;
+    }
+  }
+  return 100.0f * differing / (width * height);
+}
+
+// time the frame and, on every GOLDEN_INTERVAL-th frame, compare it or store it as the reference
+void checkGoldenFrame (){
+  double now = currentTime();
+  if(Output.frame > 0){
+    double frameTime = now - Golden.lastTime;
+    Golden.totalTime += frameTime;
+    Golden.worstTime = max(Golden.worstTime, frameTime);
+    Golden.timedFrames++;
+  }
+  Golden.lastTime = now;
+
+  if(Output.frame == 0 || Output.frame % GOLDEN_INTERVAL != 0){
+    return;
+  }
+  Golden.compared++;
+
+  CapturedFrame frame;
+  readFrame(frame.copy);
+  frame.number = Output.frame;
+  frame.width = framebufferWidth;
+  frame.height = framebufferHeight;
+  frame.channels = 3;
+  frame.pixels = &frame.copy[0];
+  frame.slot = -1;
+
+  if(Options.goldenUpdate){
+    writeCapturedFrame(frame, Options.golden, false);
+    return;
+  }
+
+  char name[32];
+  snprintf(name, sizeof(name), "/frame%05d.ppm", frame.number);
+  int width, height;
+  vector<GLubyte> reference;
+  if(!readPPM(Options.golden + name, width, height, reference) || width != frame.width || height != frame.height){
+    cout << "golden : frame " << frame.number << " has no usable reference " << Options.golden + name << endl;
+    Golden.failed++;
+    return;
+  }
+
+  float difference = goldenDifference(frame.copy, reference, width, height);
+  bool passed = difference <= Options.goldenTolerance;
+  cout << "golden : frame " << frame.number << (passed ? " ok, " : " FAILED, ") << difference << "% differ" << endl;
+  Golden.failed += passed ? 0 : 1;
+}
+
+// report the run, the exit status tells whether every frame matched
+void finishGolden (){
+  double mean = Golden.timedFrames ? Golden.totalTime / Golden.timedFrames : 0;
+  cout << "golden : " << (Options.goldenUpdate ? "wrote " : "compared ") << Golden.compared << " frames, "
+       << Golden.failed << " failed, frame ms mean " << 1000 * mean << " worst " << 1000 * Golden.worstTime << endl;
+}
+
+/* Create the window or headless context for Options.backend, the GL context is current after this */
+/* Returns the window, NULL for headless backends */
+GLFWwindow* openOutput (int width, int height){
+    Output.backend = Options.backend;
+    Output.width = width;
+    Output.height = height;
+    Output.window = NULL;
+    Output.Framebuffer = Output.ColorBuffer = Output.DepthBuffer = 0;
+    Output.frame = 0;
+    Output.maxFrames = Options.frames;
+    Output.start = chrono::steady_clock::now();
+
+    switch (Output.backend) {
+#ifdef USE_GLFW
+        case BACKEND_WINDOW:
+            Output.window = initGLFW(width, height);
+            return Output.window;
+#endif
+#ifdef USE_EGL
+        case BACKEND_EGL:
+            initEGL();
+            break;
+#endif
+#ifdef USE_OSMESA
+        case BACKEND_OSMESA:
+            initOSMesa(width, height);
+            break;
+#endif
+        case BACKEND_SOFTWARE:
+            // everything goes through draw3DObject(), the paths that need shaders are off
+            Options.instancing = false;
+            Options.sdfCircles = false;
+            Options.procedural = false;
+            Options.staticLayer = false;
+            Options.staticBatch = false;
+            Options.dynamicResolution = false;
+            initSoftware(width, height);
+            startSoftwareWorkers();
+            break;
+        default:
+            fprintf(stderr, "Error: this build has no such backend, build the window with no -DUSE_ flag, egl with -DUSE_EGL, osmesa with -DUSE_OSMESA\n");
+            exit(EXIT_FAILURE);
+    }
+
+    // headless runs always end
+    if (Output.maxFrames == 0) {
+        Output.maxFrames = 600;
+    }
+
+    // EGL has no default framebuffer without a surface, draw into our own
+    if (Output.backend == BACKEND_EGL) {
+        glGenRenderbuffers(1, &Output.ColorBuffer);
+        glBindRenderbuffer(GL_RENDERBUFFER, Output.ColorBuffer);
+        glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, width, height);
+        glGenRenderbuffers(1, &Output.DepthBuffer);
+        glBindRenderbuffer(GL_RENDERBUFFER, Output.DepthBuffer);
+        glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, width, height);
+
+        glGenFramebuffers(1, &Output.Framebuffer);
+        glBindFramebuffer(GL_FRAMEBUFFER, Output.Framebuffer);
+        glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, Output.ColorBuffer);
+        glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, Output.DepthBuffer);
+        if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+            fprintf(stderr, "Error: headless framebuffer incomplete\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    return NULL;
+}
+
+/* Should the main loop stop */
+bool outputShouldClose (){
+    if (Output.maxFrames > 0 && Output.frame >= Output.maxFrames) {
+        return true;
+    }
+#ifdef USE_GLFW
+    return Output.window && glfwWindowShouldClose(Output.window);
+#else
+    return false;
+#endif
+}
+
+/* Frames in flight : a fence after every frame measures how far the GPU is behind, and waiting */
+/* on the old ones keeps the CPU from queueing more than Options.framesInFlight frames */
+const int FENCE_RING = 8;  // fences kept when only measuring, older ones are dropped unwaited
+
+struct FrameFences {
+    deque<GLsync> fences;  // oldest first, one per frame not yet seen finished
+} Fences;
+
+bool fenceSignaled (GLsync fence){
+  GLint status = GL_UNSIGNALED;
+  glGetSynciv(fence, GL_SYNC_STATUS, 1, NULL, &status);
+  return status == GL_SIGNALED;
+}
+
+// fence the frame just submitted, then wait until few enough frames are ahead of the next one
+void limitFramesInFlight (){
+  if(renderingInSoftware() || (Options.framesInFlight <= 0 && !Options.stats)){
+    return;
+  }
+  Fences.fences.push_back(glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0));
+
+  // the GPU finishes frames in order, so finished ones are at the front
+  while(Fences.fences.size() > 1 && fenceSignaled(Fences.fences.front())){
+    glDeleteSync(Fences.fences.front());
+    Fences.fences.pop_front();
+  }
+  int depth = Fences.fences.size() - (fenceSignaled(Fences.fences.back()) ? 1 : 0);
+  Stats.queueDepth += depth;
+  Stats.queueSamples++;
+  Stats.maxQueueDepth = max(Stats.maxQueueDepth, depth);
+
+  if(Options.framesInFlight <= 0){
+    while(Fences.fences.size() > FENCE_RING){
+      glDeleteSync(Fences.fences.front());
+      Fences.fences.pop_front();
+    }
+    return;
+  }
+  // the CPU works on the next frame while the rest are still queued
+  double start = currentTime();
+  while((int)Fences.fences.size() > Options.framesInFlight - 1){
+    // flush so the fence can't wait on commands still sitting in the driver
+    while(glClientWaitSync(Fences.fences.front(), GL_SYNC_FLUSH_COMMANDS_BIT, 100000000) == GL_TIMEOUT_EXPIRED);
+    glDeleteSync(Fences.fences.front());
+    Fences.fences.pop_front();
+  }
+  Stats.fenceWait += currentTime() - start;
+}
+
+/* Show the finished frame : swap the window, or wait for the headless renderer to finish it */
+void presentFrame (){
+    if (renderingInSoftware()) {
+        finishSoftwareFrame();
+    }
+
+    // before the swap, the back buffer is undefined after it
+    if (!Options.capture.empty()) {
+        captureFrame();
+    }
+    if (!Options.golden.empty()) {
+        checkGoldenFrame();
+    }
+
+    finishCursorWork();
+    waitForDeadline();
+    if (Output.window) {
+#ifdef USE_GLFW
+        glfwSwapBuffers(Output.window);
+#endif
+    }
+    else if (!renderingInSoftware()) {
+        glFinish();
+    }
+    limitFramesInFlight();
+    recordAimLatency();
+    recordFrameTime();
+    Output.frame++;
+}
+
+/* Handle window events, headless backends have none */
+void pollEvents (){
+#ifdef USE_GLFW
+    if (Output.window) {
+        glfwPollEvents();
+    }
+#endif
+}
+
+/* Release the window or headless context */
+void closeOutput (){
+    finishPacing();
+    finishAimLatency();
+    if (!Options.capture.empty()) {
+        finishCapture();
+    }
+    if (!Options.golden.empty()) {
+        finishGolden();
+    }
+    if (Output.backend == BACKEND_SOFTWARE) {
+        stopSoftwareWorkers();
+    }
+#ifdef USE_GLFW
+    if (Output.window) {
+        glfwTerminate();
+    }
+#endif
+#ifdef USE_EGL
+    if (Output.backend == BACKEND_EGL) {
+        eglMakeCurrent(Output.eglDisplay, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+        eglDestroyContext(Output.eglDisplay, Output.eglContext);
+        eglTerminate(Output.eglDisplay);
+    }
+#endif
+#ifdef USE_OSMESA
+    if (Output.backend == BACKEND_OSMESA) {
+        OSMesaDestroyContext(Output.osmesaContext);
+    }
+#endif
+}
 
 /* Initialize the OpenGL rendering properties */
 /* Add all the models to be created here */
 void initGL (GLFWwindow* window, int width, int height){
+  if(renderingInSoftware()){
+    // no shaders or buffers, only the meshes and the line batch on the CPU
+    initLines(1024);
+    if(Options.lod){
+      initLevelsOfDetail();
+    }
+    resizeFramebuffer (width, height);
+    cout << "RENDERER: software, " << Software.threads << " threads" << endl;
+    return;
+  }
+
   // Create and compile our GLSL program from the shaders
 	programID = LoadShaders( "Sample_GL.vert", "Sample_GL.frag" );
-	// Get a handle for our "MVP" uniform
-	Matrices.MatrixID = glGetUniformLocation(programID, "MVP");
+	// Camera matrices come from the Frame uniform block
+	initFrameBlock();
+	bindFrameBlock(programID);
+	// Get a handle for our per-object "transform" and "depth" uniforms
+	Matrices.TransformID = glGetUniformLocation(programID, "transform");
+	Matrices.DepthID = glGetUniformLocation(programID, "depth");
+	// Get a handle for our "objectColor" uniform
+	Material.ColorID = glGetUniformLocation(programID, "objectColor");
+	Material.TintID = glGetUniformLocation(programID, "objectTint");
+
+	// Instanced path for GameObjects
+	initInstancing();
+
+	// Ring buffer for the lines drawn every frame
+	initLines(1024);
+
+	// Scaled offscreen target for the scene
+	if(Options.dynamicResolution){
+		initDynamicResolution();
+	}
+
+	// Offscreen target for the scenery
+	if(Options.staticLayer){
+		initStaticLayer();
+	}
+	if(Options.staticBatch){
+		initStaticBatch();
+	}
 
+	// Quad and shaders for distance field circles
+	if(Options.sdfCircles){
+		initCircles();
+	}
+
+	// Meshes for round objects at every size on screen
+	if(Options.lod && !Options.procedural){
+		initLevelsOfDetail();
+	}
 	
-	reshapeWindow (window, width, height);
+	if(window){
+#ifdef USE_GLFW
+		reshapeWindow (window, width, height);
+#endif
+	}
+	else {
+		resizeFramebuffer (width, height);
+	}
 
     // Background color of the scene
 	glClearColor (0.3f, 0.3f, 0.3f, 0.0f); // R, G, B, A
@@ -1067,20 +4643,211 @@ void initGL (GLFWwindow* window, int width, int height){
 //void glEnd();
 //void glVertex2d(GLfloat x, GLfloat y);
 
+/* Print per frame averages of the counters and start counting again */
+void printStats (double elapsed){
+  int frames = max(Stats.frames, 1);
+  cout << "fps : " << Stats.frames / elapsed
+       << "  draw calls : " << Stats.drawCalls / frames
+       << "  vertices : " << Stats.vertices / frames
+       << "  state calls : " << Stats.stateCalls / frames
+       << "  elided : " << Stats.elidedCalls / frames
+       << "  draw cpu ms : " << 1000 * Stats.drawTime / frames
+       << "  capture ms : " << 1000 * Stats.captureTime / frames
+       << "  gpu ms : " << Stats.gpuTime / max(Stats.gpuFrames, 1) << "  render scale : " << renderScale()
+       << "  static redraws : " << Stats.staticRenders
+       << "  batch bakes : " << Stats.batchBakes << "  batch updates : " << Stats.batchUpdates
+       << "  queue depth : " << (double)Stats.queueDepth / max(Stats.queueSamples, 1) << " max " << Stats.maxQueueDepth
+       << "  fence wait ms : " << 1000 * Stats.fenceWait / frames
+       << "  aim latency ms : " << 1000 * Stats.aimLatency / frames
+       << "  sim steps : " << (double)Stats.simSteps / frames << " dropped " << Stats.droppedSteps
+       << "  sim ms : " << 1000 * Stats.simTime / frames
+       << "  pairs : " << Stats.broadphasePairs / max(Stats.simSteps, 1)
+       << "  sweep swaps : " << Stats.sweepSwaps / max(Stats.simSteps, 1)
+       << "  tree moves : " << Stats.treeMoves / max(Stats.simSteps, 1)
+       << "  " << frameTimeSummary(Pacing.reported) << endl;
+  Pacing.reported = Pacing.frames;
+  Stats = RenderStats();
+}
+
+/* Read command line options into Options */
+void parseOptions (int argc, char** argv){
+  // without a window the first headless backend of the build is the default
+#if defined(USE_EGL)
+  Options.backend = BACKEND_EGL;
+#elif defined(USE_OSMESA)
+  Options.backend = BACKEND_OSMESA;
+#elif !defined(USE_GLFW)
+  Options.backend = BACKEND_SOFTWARE;
+#endif
+  for(int i = 1; i < argc; i++){
+    string arg = argv[i];
+    if(arg == "--no-instancing"){
+      Options.instancing = false;
+    }
+    else if(arg == "--stress" && i + 1 < argc){
+      Options.stressObjects = atoi(argv[++i]);
+    }
+    else if(arg == "--legacy-polygons"){
+      Options.fanPolygons = false;
+    }
+    else if(arg == "--stats"){
+      Options.stats = true;
+    }
+    else if(arg == "--no-lod"){
+      Options.lod = false;
+    }
+    else if(arg == "--lod-tolerance" && i + 1 < argc){
+      Options.lodTolerance = atof(argv[++i]);
+    }
+    else if(arg == "--sdf-circles"){
+      Options.sdfCircles = true;
+    }
+    else if(arg == "--circle-outline" && i + 1 < argc){
+      Options.circleOutline = atof(argv[++i]);
+    }
+    else if(arg == "--procedural"){
+      Options.procedural = true;
+    }
+    else if(arg == "--static-layer"){
+      Options.staticLayer = true;
+    }
+    else if(arg == "--static-batch"){
+      Options.staticBatch = true;
+    }
+    else if(arg == "--backend" && i + 1 < argc){
+      string name = argv[++i];
+      if(name == "window"){
+        Options.backend = BACKEND_WINDOW;
+      }
+      else if(name == "egl"){
+        Options.backend = BACKEND_EGL;
+      }
+      else if(name == "osmesa"){
+        Options.backend = BACKEND_OSMESA;
+      }
+      else if(name == "software"){
+        Options.backend = BACKEND_SOFTWARE;
+      }
+      else {
+        cout << "unknown backend : " << name << endl;
+      }
+    }
+    else if(arg == "--frames" && i + 1 < argc){
+      Options.frames = atoi(argv[++i]);
+    }
+    else if(arg == "--capture" && i + 1 < argc){
+      Options.capture = argv[++i];
+    }
+    else if(arg == "--capture-png"){
+      Options.capturePNG = true;
+    }
+    else if(arg == "--golden" && i + 1 < argc){
+      Options.golden = argv[++i];
+    }
+    else if(arg == "--golden-update"){
+      Options.goldenUpdate = true;
+    }
+    else if(arg == "--golden-tolerance" && i + 1 < argc){
+      Options.goldenTolerance = atof(argv[++i]);
+    }
+    else if(arg == "--dynamic-resolution"){
+      Options.dynamicResolution = true;
+    }
+    else if(arg == "--frame-budget" && i + 1 < argc){
+      Options.frameBudget = atof(argv[++i]);
+    }
+    else if(arg == "--min-scale" && i + 1 < argc){
+      Options.minScale = atof(argv[++i]);
+    }
+    else if(arg == "--max-scale" && i + 1 < argc){
+      Options.maxScale = atof(argv[++i]);
+    }
+    else if(arg == "--pacing" && i + 1 < argc){
+      string name = argv[++i];
+      if(name == "vsync"){
+        Options.pacing = PACING_VSYNC;
+      }
+      else if(name == "adaptive"){
+        Options.pacing = PACING_ADAPTIVE;
+      }
+      else if(name == "uncapped"){
+        Options.pacing = PACING_UNCAPPED;
+      }
+      else if(name == "limit"){
+        Options.pacing = PACING_LIMIT;
+      }
+      else {
+        cout << "unknown pacing : " << name << endl;
+      }
+    }
+    else if(arg == "--frames-in-flight" && i + 1 < argc){
+      Options.framesInFlight = min(max(atoi(argv[++i]), 1), 3);
+    }
+    else if(arg == "--late-latch"){
+      Options.lateLatch = true;
+    }
+    else if(arg == "--cursor-prediction"){
+      Options.cursorPrediction = true;
+    }
+    else if(arg == "--step-rate" && i + 1 < argc){
+      Options.stepRate = max(atof(argv[++i]), 1.0);
+    }
+    else if(arg == "--max-steps" && i + 1 < argc){
+      Options.maxSteps = max(atoi(argv[++i]), 1);
+    }
+    else if(arg == "--broadphase" && i + 1 < argc){
+      string name = argv[++i];
+      if(name == "grid"){
+        Options.broadphase = BROADPHASE_GRID;
+      }
+      else if(name == "sweep"){
+        Options.broadphase = BROADPHASE_SWEEP;
+      }
+      else if(name == "tree"){
+        Options.broadphase = BROADPHASE_TREE;
+      }
+      else {
+        cout << "unknown broadphase : " << name << endl;
+      }
+    }
+    else if(arg == "--grid-cell" && i + 1 < argc){
+      Options.gridCell = max(atof(argv[++i]), 0.01);
+    }
+    else if(arg == "--fps" && i + 1 < argc){
+      Options.frameRate = atof(argv[++i]);
+      Options.pacing = PACING_LIMIT;
+    }
+    else {
+      cout << "unknown option : " << arg << endl;
+    }
+  }
+}
+
 int main (int argc, char** argv){
 	int width = 600;
 	int height = 600;
 
-  GLFWwindow* window = initGLFW(width, height);
+  parseOptions(argc, argv);
+
+  GLFWwindow* window = openOutput(width, height);
+  initPacing();
 
   /* Objects should be created before any other gl function and shaders */
   createAllObjects ();
 
+  /* Without a mouse the player rests where it starts */
+  Output.cursorX = (allGameObjects["player"].getPosition().x + 4) * 75.0;
+  Output.cursorY = (4 - allGameObjects["player"].getPosition().y) * 75.0;
+
   /* Initialize the OpenGL rendering properties */
 	initGL (window, width, height);
+
+  /* Read back and save every frame */
+  if(!Options.capture.empty()){
+    initCapture();
+  }
   
-  double xcoor, ycoor;
-  double last_update_time = glfwGetTime(), current_time;
+  double last_update_time = currentTime(), current_time;
 
   GLfloat line_data[6];
   
@@ -1092,46 +4859,42 @@ int main (int argc, char** argv){
   line_data[5] = 0;
 
   /* Draw in loop */
-  while (!glfwWindowShouldClose(window)) {
+  while (!outputShouldClose()) {
     
     line_data[3] = allGameObjects["player"].getPosition().x;
     line_data[4] = allGameObjects["player"].getPosition().y;
 
-    handleCollisions();
-
     //cout<<"initially "<<allGameObjects["player"].getPosition().x<<" "<<allGameObjects["player"].getPosition().y<<endl;
-    // get cursor position
-    glfwGetCursorPos(window, &xcoor, &ycoor);
-    //cout<<"mouse "<<xcoor<<" "<<ycoor<<" "<<endl;
-    if(!fired){
-      allGameObjects["player"].setPosition(xcoor/75.0 - 4, 4.0 - 1.0 * ycoor/75.0, 0.0);
-    }
+    // get cursor position, the player follows it while aiming
+    sampleCursor();
     //cout<<"finally "<<allGameObjects["player"].getPosition().x<<" "<<allGameObjects["player"].getPosition().y<<endl<<endl;
-    // first need to update states of all objects
-    updateAllObjects();
+    // first need to update states of all objects, in fixed steps for the time that passed
+    advanceSimulation();
 
     // then draw all
     drawAllObjects();
+    Stats.frames++;
 
     //mcout<<line_data[3]<<endl;
     //if(allGameObjects["player"].getVelocity().x == 2.22222e-06 || allGameObjects["player"].getVelocity().y == 4.44444e-05)
-    allGameObjects["player"].setRotationValue(allGameObjects["player"].getRotationValue() + 5);
-
     // Swap Frame Buffer in double buffering
-    glfwSwapBuffers(window);
+    presentFrame();
 
     // Poll for Keyboard and mouse events
-    glfwPollEvents();
+    pollEvents();
 
     // Control based on time (Time based transformation like 5 degrees rotation every 0.5s)
-    current_time = glfwGetTime(); // Time in seconds
+    current_time = currentTime(); // Time in seconds
     if ((current_time - last_update_time) >= 0.5) { // atleast 0.5s elapsed since last frame
       // do something every 0.5 seconds ..
+        if(Options.stats){
+          printStats(current_time - last_update_time);
+        }
         last_update_time = current_time;
       }
   }
 
   // exit functions
-  glfwTerminate();
-  exit(EXIT_SUCCESS);
+  closeOutput();
+  exit(Golden.failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
 }
\ No newline at end of file